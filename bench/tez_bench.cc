@@ -0,0 +1,239 @@
+// Benchmarks for TEZ's hot paths, run against the zipfile that
+// tez_bench_gen appends to this executable. Each benchmark prints one line of
+// JSON, so results can be collected and compared between builds:
+//
+//   {"name": "find", "iterations": 1048576, "ns_per_op": 31.2,
+//    "bytes_per_second": 0}
+//
+// Build it with the same TEZ_* defines as your program, then give it some
+// data (see tez_bench_gen.cc):
+//
+//   g++ -std=c++14 -O2 -I.. tez_bench.cc ../tez_archive.cc ../tez_file.cc
+//     -o tez_bench -pthread -lz
+//   tez_bench_gen tez_bench
+//   tez_bench [--filter=substring] [--min-time=seconds]
+//
+// The threads_* benchmarks show how reads scale with the I/O backend, which
+// is picked when tez_archive.cc is compiled; to compare the lock-free
+// backends with the mutex-protected stream, build a second copy with
+// -DTEZ_USE_STREAM (or -DTEZ_USE_PREAD), give it data the same way, and run
+// both with --filter=threads_.
+//
+// Reads go through the page cache like any other, so run everything once
+// before believing the numbers.
+
+#include "tez.hh"
+
+#include <chrono>
+#include <cstdlib>
+#include <functional>
+#include <iostream>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <vector>
+
+namespace {
+  std::string filter;
+  double min_time = 0.5;
+  // xorshift64*, the same as tez_bench_gen's
+  class rng {
+    uint64_t state;
+  public:
+    explicit rng(uint64_t seed) : state(seed * 2 + 1) {}
+    uint32_t next() {
+      state ^= state >> 12;
+      state ^= state << 25;
+      state ^= state >> 27;
+      return static_cast<uint32_t>((state * 0x2545F4914F6CDD1DULL) >> 32);
+    }
+  };
+  // keeps the optimizer from throwing away reads whose results go unused
+  volatile uint8_t sink;
+  // calls body (which does ops operations and processes bytes bytes) over and
+  // over until min_time has passed, and reports the average
+  void run(const std::string& name,
+           const std::function<void(uint64_t& ops, uint64_t& bytes)>& body) {
+    if(name.find(filter) == std::string::npos) return;
+    using clock = std::chrono::steady_clock;
+    uint64_t ops = 0, bytes = 0;
+    auto start = clock::now();
+    double elapsed;
+    do {
+      body(ops, bytes);
+      elapsed = std::chrono::duration<double>(clock::now() - start).count();
+    } while(elapsed < min_time);
+    std::cout << "{\"name\": \"" << name << "\", \"iterations\": " << ops
+              << ", \"ns_per_op\": " << elapsed * 1e9 / ops
+              << ", \"bytes_per_second\": "
+              << static_cast<uint64_t>(bytes / elapsed) << "}" << std::endl;
+  }
+  uint64_t read_stream(std::istream& s) {
+    char buf[65536];
+    uint64_t ret = 0;
+    while(s.read(buf, sizeof(buf)) || s.gcount() > 0) {
+      ret += s.gcount();
+      sink = buf[0];
+    }
+    return ret;
+  }
+  void run_all(const char* argv0) {
+    run("init", [&](uint64_t& ops, uint64_t&) {
+      TEZ::archive tez;
+      tez.init(argv0);
+      ++ops;
+    });
+    TEZ::archive tez;
+    tez.init(argv0);
+    std::vector<const TEZ::file*> small, huge_deflated;
+    const TEZ::file* huge_stored = nullptr;
+    std::vector<std::string> names, missing_names;
+    for(auto&& f : tez) {
+      std::string name = f.get_filename();
+      if(f.is_directory()) continue;
+      names.push_back(name);
+      missing_names.push_back(name + "_");
+      if(name.compare(0, 6, "small/") == 0) small.push_back(&f);
+      else if(f.get_compressed_size() == f.get_uncompressed_size())
+        huge_stored = &f;
+      else huge_deflated.push_back(&f);
+    }
+    if(small.empty() || huge_deflated.empty() || huge_stored == nullptr)
+      throw std::runtime_error("no benchmark data; run tez_bench_gen first");
+    rng r(2);
+    run("find", [&](uint64_t& ops, uint64_t&) {
+      for(int n = 0; n < 65536; ++n) {
+        if(tez.find(names[r.next() % names.size()]) == tez.end())
+          throw std::logic_error("find failed");
+      }
+      ops += 65536;
+    });
+    run("find_missing", [&](uint64_t& ops, uint64_t&) {
+      for(int n = 0; n < 65536; ++n) {
+        if(tez.find(missing_names[r.next() % names.size()]) != tez.end())
+          throw std::logic_error("find succeeded");
+      }
+      ops += 65536;
+    });
+    run("operator[]", [&](uint64_t& ops, uint64_t&) {
+      for(int n = 0; n < 65536; ++n)
+        sink = tez[names[r.next() % names.size()]].get_crc32() != 0;
+      ops += 65536;
+    });
+    // metadata only: what a size total or a filter by method or directory
+    // costs, which is mostly a matter of how many files fit in a cache line
+    run("scan_metadata", [&](uint64_t& ops, uint64_t&) {
+      uint64_t total = 0;
+      for(auto&& f : tez) {
+        if(!f.is_directory() && f.get_compressed_size()
+           != f.get_uncompressed_size())
+          total += f.get_uncompressed_size();
+      }
+      sink = static_cast<uint8_t>(total);
+      ops += tez.end() - tez.begin();
+    });
+    run("open_read_small", [&](uint64_t& ops, uint64_t& bytes) {
+      for(auto f : small) {
+        auto s = f->open(tez);
+        bytes += read_stream(*s);
+      }
+      ops += small.size();
+    });
+    run("read_all_small", [&](uint64_t& ops, uint64_t& bytes) {
+      std::vector<uint8_t> buf(8192);
+      for(auto f : small) {
+        bytes += f->read_all(tez, buf.data(), buf.size());
+        sink = buf[0];
+      }
+      ops += small.size();
+    });
+    run("open_read_huge_deflated", [&](uint64_t& ops, uint64_t& bytes) {
+      auto s = huge_deflated[0]->open(tez);
+      bytes += read_stream(*s);
+      ++ops;
+    });
+    run("open_read_huge_stored", [&](uint64_t& ops, uint64_t& bytes) {
+      auto s = huge_stored->open(tez);
+      bytes += read_stream(*s);
+      ++ops;
+    });
+    run("read_all_huge_deflated", [&](uint64_t& ops, uint64_t& bytes) {
+      bytes += huge_deflated[0]->read_all(tez).size();
+      ++ops;
+    });
+    // random 4KiB reads; without a seek index, every backward seek starts
+    // over from the beginning, so this has to come before build_seek_index
+    auto random_seeks = [&](const TEZ::file* f, int count) {
+      return [&, f, count](uint64_t& ops, uint64_t& bytes) {
+        auto s = f->open(tez);
+        auto size = f->get_uncompressed_size() - 4096;
+        char buf[4096];
+        for(int n = 0; n < count; ++n) {
+          s->seekg((uint64_t(r.next()) << 16 ^ r.next()) % size);
+          s->read(buf, sizeof(buf));
+          sink = buf[0];
+          bytes += s->gcount();
+        }
+        ops += count;
+      };
+    };
+    run("seek_huge_deflated", random_seeks(huge_deflated[0], 16));
+    run("seek_huge_stored", random_seeks(huge_stored, 4096));
+    huge_deflated[0]->build_seek_index(tez);
+    run("seek_huge_deflated_indexed", random_seeks(huge_deflated[0], 256));
+    for(unsigned threads : {1, 2, 4, 8, 16, 64}) {
+      run("threads_read_all_small/" + std::to_string(threads),
+          [&](uint64_t& ops, uint64_t& bytes) {
+        std::vector<std::thread> pool;
+        std::vector<uint64_t> counts(threads);
+        for(unsigned t = 0; t < threads; ++t) {
+          pool.emplace_back([&, t] {
+            std::vector<uint8_t> buf(8192);
+            for(size_t n = t; n < small.size(); n += threads)
+              counts[t] += small[n]->read_all(tez, buf.data(), buf.size());
+          });
+        }
+        for(auto& thread : pool) thread.join();
+        for(auto count : counts) bytes += count;
+        ops += small.size();
+      });
+    }
+    for(unsigned threads : {1, 2, 4, 8, 16, 64}) {
+      run("threads_open_read_huge/" + std::to_string(threads),
+          [&](uint64_t& ops, uint64_t& bytes) {
+        std::vector<std::thread> pool;
+        std::vector<uint64_t> counts(threads);
+        for(unsigned t = 0; t < threads; ++t) {
+          pool.emplace_back([&, t] {
+            auto f = huge_deflated[t % huge_deflated.size()];
+            auto s = f->open(tez);
+            counts[t] = read_stream(*s);
+          });
+        }
+        for(auto& thread : pool) thread.join();
+        for(auto count : counts) bytes += count;
+        ops += threads;
+      });
+    }
+  }
+}
+
+int main(int argc, char* argv[]) {
+  for(int n = 1; n < argc; ++n) {
+    std::string arg = argv[n];
+    if(arg.compare(0, 9, "--filter=") == 0) filter = arg.substr(9);
+    else if(arg.compare(0, 11, "--min-time=") == 0)
+      min_time = std::atof(arg.c_str() + 11);
+    else {
+      std::cerr << "usage: " << argv[0]
+                << " [--filter=substring] [--min-time=seconds]\n";
+      return 2;
+    }
+  }
+  try { run_all(argv[0]); }
+  catch(const std::exception& e) {
+    std::cerr << argv[0] << ": " << e.what() << "\n";
+    return 1;
+  }
+  return 0;
+}
@@ -0,0 +1,196 @@
+// Appends a synthetic zipfile to an executable (normally tez_bench), for
+// benchmarking. The offsets are written relative to the start of the file, so
+// there's no need for zip --adjust-sfx afterward. The zipfile contains:
+//
+// - small/NN/NNNNNN.txt: lots of small files, 256 bytes to 8KiB, alternately
+//   stored and deflated, spread over 64 subdirectories
+// - huge/N.bin: a few big deflated files, plus one stored one
+//
+// All of the data is compressible, pseudorandom text, the same every time.
+//
+//   g++ -std=c++14 -O2 tez_bench_gen.cc -o tez_bench_gen -lz
+//   tez_bench_gen tez_bench [small_count [huge_count [huge_mib]]]
+
+#include <zlib.h>
+
+#include <cstdint>
+#include <cstdlib>
+#include <fstream>
+#include <iomanip>
+#include <iostream>
+#include <sstream>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+namespace {
+  void put_uint16(std::vector<uint8_t>& out, uint16_t value) {
+    out.push_back(static_cast<uint8_t>(value));
+    out.push_back(static_cast<uint8_t>(value >> 8));
+  }
+  void put_uint32(std::vector<uint8_t>& out, uint32_t value) {
+    put_uint16(out, static_cast<uint16_t>(value));
+    put_uint16(out, static_cast<uint16_t>(value >> 16));
+  }
+  // xorshift64*, so the data doesn't depend on the standard library
+  class rng {
+    uint64_t state;
+  public:
+    explicit rng(uint64_t seed) : state(seed * 2 + 1) {}
+    uint32_t next() {
+      state ^= state >> 12;
+      state ^= state << 25;
+      state ^= state >> 27;
+      return static_cast<uint32_t>((state * 0x2545F4914F6CDD1DULL) >> 32);
+    }
+  };
+  // words from a small vocabulary, which deflates to around a third of its
+  // size, like real text
+  std::vector<uint8_t> make_text(rng& r, size_t len) {
+    static const char* const words[] = {
+      "the ", "of ", "and ", "archive ", "file ", "stream ", "to ", "in ",
+      "deflate ", "central ", "directory ", "is ", "a ", "executable ",
+      "zip ", "offset ", "block ", "window ", "bytes ", "read ", "seek ",
+      "cache ", "thread ", "lock ", "data ", "index ", "member ", "header ",
+      "size ", "crc ", "checksum ", "\n",
+    };
+    std::vector<uint8_t> ret;
+    ret.reserve(len + 16);
+    while(ret.size() < len) {
+      const char* word = words[r.next() % (sizeof(words)/sizeof(*words))];
+      while(*word) ret.push_back(static_cast<uint8_t>(*word++));
+    }
+    ret.resize(len);
+    return ret;
+  }
+  std::vector<uint8_t> deflate_raw(const std::vector<uint8_t>& in) {
+    z_stream z = {};
+    if(deflateInit2(&z, 6, Z_DEFLATED, -15, 8, Z_DEFAULT_STRATEGY) != Z_OK)
+      throw std::runtime_error("zlib error");
+    std::vector<uint8_t> out(deflateBound(&z, static_cast<uLong>(in.size())));
+    z.next_in = const_cast<uint8_t*>(in.data());
+    z.avail_in = static_cast<uInt>(in.size());
+    z.next_out = out.data();
+    z.avail_out = static_cast<uInt>(out.size());
+    int ret = deflate(&z, Z_FINISH);
+    out.resize(z.total_out);
+    deflateEnd(&z);
+    if(ret != Z_STREAM_END) throw std::runtime_error("zlib error");
+    return out;
+  }
+  class zip_writer {
+    std::ofstream& f;
+    uint64_t pos;
+    std::vector<uint8_t> cd;
+    uint32_t count = 0;
+  public:
+    zip_writer(std::ofstream& f, uint64_t pos) : f(f), pos(pos) {}
+    void add(const std::string& name, const std::vector<uint8_t>& data,
+             bool compress) {
+      std::vector<uint8_t> deflated;
+      if(compress) deflated = deflate_raw(data);
+      const std::vector<uint8_t>& body = compress ? deflated : data;
+      uint32_t crc = static_cast<uint32_t>
+        (crc32(0, data.data(), static_cast<uInt>(data.size())));
+      uint16_t method = compress ? 8 : 0;
+      uint16_t version = compress ? 20 : 10;
+      if(pos + body.size() + name.size() >= 0xFFFFFFFF || count == 0xFFFE)
+        throw std::length_error("too much data; this tool doesn't do Zip64");
+      std::vector<uint8_t> header;
+      put_uint32(header, 0x04034b50);
+      put_uint16(header, version);
+      put_uint16(header, 0); // flags
+      put_uint16(header, method);
+      put_uint16(header, 0); // time
+      put_uint16(header, 0x21); // date (1980-01-01)
+      put_uint32(header, crc);
+      put_uint32(header, static_cast<uint32_t>(body.size()));
+      put_uint32(header, static_cast<uint32_t>(data.size()));
+      put_uint16(header, static_cast<uint16_t>(name.size()));
+      put_uint16(header, 0);
+      header.insert(header.end(), name.begin(), name.end());
+      put_uint32(cd, 0x02014b50);
+      put_uint16(cd, version); // made by
+      put_uint16(cd, version); // needed
+      put_uint16(cd, 0);
+      put_uint16(cd, method);
+      put_uint16(cd, 0);
+      put_uint16(cd, 0x21);
+      put_uint32(cd, crc);
+      put_uint32(cd, static_cast<uint32_t>(body.size()));
+      put_uint32(cd, static_cast<uint32_t>(data.size()));
+      put_uint16(cd, static_cast<uint16_t>(name.size()));
+      put_uint16(cd, 0); // extra
+      put_uint16(cd, 0); // comment
+      put_uint16(cd, 0); // disk
+      put_uint16(cd, 0); // internal attributes
+      put_uint32(cd, 0); // external attributes
+      put_uint32(cd, static_cast<uint32_t>(pos));
+      cd.insert(cd.end(), name.begin(), name.end());
+      f.write(reinterpret_cast<const char*>(header.data()), header.size());
+      f.write(reinterpret_cast<const char*>(body.data()), body.size());
+      pos += header.size() + body.size();
+      ++count;
+    }
+    void finish() {
+      if(pos + cd.size() >= 0xFFFFFFFF)
+        throw std::length_error("too much data; this tool doesn't do Zip64");
+      std::vector<uint8_t> out = cd;
+      put_uint32(out, 0x06054b50);
+      put_uint16(out, 0);
+      put_uint16(out, 0);
+      put_uint16(out, static_cast<uint16_t>(count));
+      put_uint16(out, static_cast<uint16_t>(count));
+      put_uint32(out, static_cast<uint32_t>(cd.size()));
+      put_uint32(out, static_cast<uint32_t>(pos));
+      put_uint16(out, 0); // comment
+      f.write(reinterpret_cast<const char*>(out.data()), out.size());
+    }
+  };
+  void run(const std::string& path, unsigned small_count,
+           unsigned huge_count, unsigned huge_mib) {
+    std::ofstream f(path, std::ios::binary | std::ios::app);
+    if(!f) throw std::runtime_error("could not open " + path);
+    f.seekp(0, std::ios::end);
+    zip_writer zip(f, static_cast<uint64_t>(f.tellp()));
+    rng r(1);
+    for(unsigned n = 0; n < small_count; ++n) {
+      std::ostringstream name;
+      name << "small/" << std::setw(2) << std::setfill('0') << n % 64 << "/"
+           << std::setw(6) << n << ".txt";
+      zip.add(name.str(), make_text(r, 256 + r.next() % (8192 - 256)),
+              n % 2 != 0);
+    }
+    for(unsigned n = 0; n <= huge_count; ++n) {
+      // the last one is stored
+      std::ostringstream name;
+      name << "huge/" << n << ".bin";
+      zip.add(name.str(), make_text(r, size_t(huge_mib) << 20),
+              n != huge_count);
+    }
+    zip.finish();
+    f.close();
+    if(!f) throw std::runtime_error("could not write " + path);
+  }
+}
+
+int main(int argc, char* argv[]) {
+  if(argc < 2 || argc > 5) {
+    std::cerr << "usage: " << argv[0]
+              << " executable [small_count [huge_count [huge_mib]]]\n";
+    return 2;
+  }
+  unsigned small_count = argc > 2 ? std::atoi(argv[2]) : 20000;
+  unsigned huge_count = argc > 3 ? std::atoi(argv[3]) : 2;
+  unsigned huge_mib = argc > 4 ? std::atoi(argv[4]) : 64;
+  if(huge_mib > 1024) {
+    std::cerr << argv[0] << ": huge files can be at most 1024MiB\n";
+    return 2;
+  }
+  try { run(argv[1], small_count, huge_count, huge_mib); }
+  catch(const std::exception& e) {
+    std::cerr << argv[1] << ": " << e.what() << "\n";
+    return 1;
+  }
+  return 0;
+}
@@ -1,79 +1,557 @@
 #ifndef TEZHH
 #define TEZHH
 
+#include <atomic>
+#include <condition_variable>
+#include <deque>
 #include <fstream>
+#include <iterator>
 #include <functional>
+#include <future>
+#include <list>
 #include <memory>
 #include <mutex>
+#include <stdint.h>
+#include <string.h>
+#include <thread>
 #include <unordered_map>
 #include <vector>
+#if __cplusplus >= 201703L
+#include <string_view>
+#endif
 
 // all TEZ functions throw an exception on failure!
 namespace TEZ {
   class archive;
+  struct seek_index; // see tez_file.cc
+  // how tez_file.cc's streambufs get at an archive's counters
+  struct stats_access;
+  // a reusable zlib inflate state and its buffers, also in tez_file.cc
+  struct inflater;
+  struct inflater_deleter { void operator()(inflater*) const; };
+  typedef std::unique_ptr<inflater, inflater_deleter> inflater_ptr;
+  // a read-only view of some bytes owned by someone else
+  class data_span {
+    const uint8_t* ptr;
+    size_t len;
+    // keeps the bytes alive, if they don't belong to the mapping
+    std::shared_ptr<const void> owner;
+  public:
+    data_span() : ptr(nullptr), len(0) {}
+    data_span(const uint8_t* ptr, size_t len) : ptr(ptr), len(len) {}
+    data_span(const uint8_t* ptr, size_t len, std::shared_ptr<const void> owner)
+      : ptr(ptr), len(len), owner(std::move(owner)) {}
+    const uint8_t* data() const { return ptr; }
+    size_t size() const { return len; }
+    bool empty() const { return len == 0; }
+    const uint8_t* begin() const { return ptr; }
+    const uint8_t* end() const { return ptr + len; }
+    const uint8_t& operator[](size_t index) const { return ptr[index]; }
+  };
+  // a read-only view of some characters owned by someone else; a subset of
+  // C++17's std::string_view, which we can't rely on having
+  class string_view {
+    const char* ptr;
+    size_t len;
+  public:
+    typedef const char* iterator;
+    typedef const char* const_iterator;
+    using reverse_iterator = std::reverse_iterator<const char*>;
+    using const_reverse_iterator = std::reverse_iterator<const char*>;
+    static constexpr size_t npos = size_t(-1);
+    string_view() : ptr(""), len(0) {}
+    string_view(const char* ptr, size_t len) : ptr(ptr), len(len) {}
+    string_view(const char* str) : ptr(str), len(strlen(str)) {}
+    string_view(const std::string& str) : ptr(str.data()), len(str.size()) {}
+    operator std::string() const { return std::string(ptr, len); }
+#if __cplusplus >= 201703L
+    string_view(std::string_view str) : ptr(str.data()), len(str.size()) {}
+    operator std::string_view() const { return std::string_view(ptr, len); }
+#endif
+    const char* data() const { return ptr; }
+    size_t size() const { return len; }
+    size_t length() const { return len; }
+    bool empty() const { return len == 0; }
+    const char* begin() const { return ptr; }
+    const char* end() const { return ptr + len; }
+    const char* cbegin() const { return ptr; }
+    const char* cend() const { return ptr + len; }
+    auto rbegin() const { return reverse_iterator(ptr + len); }
+    auto rend() const { return reverse_iterator(ptr); }
+    const char& operator[](size_t index) const { return ptr[index]; }
+    const char& front() const { return ptr[0]; }
+    const char& back() const { return ptr[len-1]; }
+    string_view substr(size_t pos, size_t count = npos) const {
+      if(pos > len) throw std::out_of_range("substring out of range");
+      if(count > len - pos) count = len - pos;
+      return string_view(ptr + pos, count);
+    }
+    int compare(string_view other) const {
+      int ret = memcmp(ptr, other.ptr, len < other.len ? len : other.len);
+      if(ret != 0) return ret;
+      else if(len < other.len) return -1;
+      else if(len > other.len) return 1;
+      else return 0;
+    }
+    int compare(size_t pos, size_t count, string_view other) const {
+      return substr(pos, count).compare(other);
+    }
+  };
+  inline bool operator==(string_view a, string_view b) {
+    return a.size() == b.size() && memcmp(a.data(), b.data(), a.size()) == 0;
+  }
+  inline bool operator!=(string_view a, string_view b) { return !(a == b); }
+  inline bool operator<(string_view a, string_view b) {
+    return a.compare(b) < 0;
+  }
+  inline std::ostream& operator<<(std::ostream& out, string_view str) {
+    return out.write(str.data(), str.size());
+  }
+  // the CRC32 zlib would compute, but faster where the CPU can help (see
+  // tez_file.cc)
+  uint32_t crc32_update(uint32_t crc, const void* buf, size_t len);
+  // when to check a file's CRC: every time it's read all the way through,
+  // only until it's been checked once, or not at all
+  enum class verify_policy { always, first_read, never };
   class file {
-    uint32_t offset;
-    uint32_t crc32, compressed_size, uncompressed_size;
-    const std::string* filename; // owned by file_map
-    std::unique_ptr<std::string> comment;
+    // offsets and sizes are 48 bits (thanks to Zip64), split up so that a file
+    // is no bigger than it was when they were all 32 bits: the low 32 bits,
+    // and the high 16 bits
+    // offset of the local file header
+    uint32_t offset_low;
+    // how far past the local file header the data starts, found by reading
+    // the header the first time we need it; 0 if we haven't yet (the header
+    // can't be empty, so 0 is never valid); the top bit is VERIFIED instead,
+    // since a header can't be anywhere near 2GiB, and that keeps the whole
+    // file at 40 bytes with no padding
+    mutable std::atomic<uint32_t> data_skip{0};
+    uint32_t crc32, compressed_size_low, uncompressed_size_low;
+    uint16_t offset_high, compressed_size_high, uncompressed_size_high;
+    uint16_t filename_length, comment_length;
     uint16_t method;
-    void read_header(archive&, uint32_t);
+    // points into the archive's string arena; the comment comes right after
+    // the filename
+    const char* filename;
+    static uint64_t join(uint16_t high, uint32_t low) {
+      return uint64_t(high) << 32 | low;
+    }
+    static void split(uint64_t value, uint16_t& high, uint32_t& low) {
+      if(value >> 48 != 0)
+        throw std::out_of_range("file offset or size is too big");
+      high = static_cast<uint16_t>(value >> 32);
+      low = static_cast<uint32_t>(value);
+    }
+    uint64_t get_offset() const { return join(offset_high, offset_low); }
+    uint32_t read_header(archive&) const;
+    // policy is normally the archive's (see file::open)
+    void read_all_uncached(archive&, void* dst, verify_policy policy) const;
+    // checks the CRC of the whole decompressed file, if the policy says to
+    void verify(archive&, const void* data, verify_policy policy) const;
+    // for read_all_uncached: decompresses the file from in (all of its
+    // compressed data) using several threads, and returns true, if the
+    // archive says to and the file has a seek index that makes it possible
+    bool read_in_parallel(archive&, const uint8_t* in, void* dst,
+                          verify_policy policy) const;
+    uint64_t get_data_offset(archive& tez) const {
+      auto skip = data_skip.load(std::memory_order_acquire) & ~VERIFIED;
+      if(skip == 0) {
+        // if two threads race here, they'll both read the same header and
+        // store the same value, so no harm done; or'ing it in leaves
+        // VERIFIED alone
+        skip = read_header(tez);
+        data_skip.fetch_or(skip, std::memory_order_release);
+      }
+      return get_offset() + skip;
+    }
+    // whether policy checks CRCs in cases where the other doesn't (always is
+    // stricter than first_read, which is stricter than never)
+    static bool stricter(verify_policy policy, verify_policy other) {
+      return static_cast<int>(policy) < static_cast<int>(other);
+    }
+    bool wants_verify(verify_policy policy) const {
+      return policy == verify_policy::always
+        || (policy == verify_policy::first_read
+            && !(data_skip.load(std::memory_order_relaxed) & VERIFIED));
+    }
+    // where to record a successful check (by or'ing in VERIFIED), or nullptr
+    // if it doesn't matter
+    std::atomic<uint32_t>* verified_flag(verify_policy policy) const {
+      return policy == verify_policy::first_read ? &data_skip : nullptr;
+    }
+    void mark_verified() const {
+      data_skip.fetch_or(VERIFIED, std::memory_order_relaxed);
+    }
     friend class archive;
   public:
-    const std::string& get_filename() const { return *filename; }
+    // the bit of data_skip that says the CRC has been checked (and was
+    // right), for verify_policy::first_read; used by the streambufs
+    static constexpr uint32_t VERIFIED = 0x80000000;
+    string_view get_filename() const {
+      return string_view(filename, filename_length);
+    }
     bool is_directory() const {
-      if(!filename->empty()) return *filename->rbegin() == '/';
+      if(filename_length != 0) return filename[filename_length-1] == '/';
       else return false; // should never happen
     }
     uint32_t get_crc32() const { return crc32; }
-    uint32_t get_compressed_size() const { return compressed_size; }
-    uint32_t get_uncompressed_size() const { return uncompressed_size; }
-    const std::string& get_comment() {
-      if(!comment) comment = std::make_unique<std::string>();
-      return *comment;
+    uint64_t get_compressed_size() const {
+      return join(compressed_size_high, compressed_size_low);
+    }
+    uint64_t get_uncompressed_size() const {
+      return join(uncompressed_size_high, uncompressed_size_low);
+    }
+    string_view get_comment() const {
+      return string_view(filename + filename_length, comment_length);
     }
+    // the comment lives in the archive's string arena, so this doesn't free
+    // anything, but future calls to get_comment will return an empty string
     std::string purge_comment() {
-      if(!comment) return std::string();
-      else {
-        std::string ret = std::move(*comment);
-        comment.reset();
-        return ret;
-      }
+      std::string ret(filename + filename_length, comment_length);
+      comment_length = 0;
+      return ret;
     }
     std::unique_ptr<std::istream> open(archive&) const;
+    // as above, but checks the CRC according to the given policy instead of
+    // the archive's, and/or reads (and decompresses) buffer_size bytes at a
+    // time instead of 4KiB (0 means the default)
+    std::unique_ptr<std::istream> open(archive&, verify_policy,
+                                       size_t buffer_size = 0) const;
+    std::unique_ptr<std::istream> open(archive&, size_t buffer_size) const;
+    // returns the file's data, in place, without copying it, if that's
+    // possible (the file is stored and the executable is mapped), or from the
+    // archive's cache (if it's enabled and the file fits); otherwise, returns
+    // a span whose data() is nullptr
+    data_span data_view(archive&) const;
+    // reads (and decompresses, and checks) the whole file in one go, into a
+    // buffer at least get_uncompressed_size() bytes long; returns the number of
+    // bytes read
+    size_t read_all(archive&, void* dst, size_t cap) const;
+    std::vector<uint8_t> read_all(archive&) const;
+    // returns the whole decompressed file, from the archive's cache if it's
+    // there, putting it in the cache if it isn't (and it fits); as long as you
+    // keep the returned pointer, the data stays in the cache
+    std::shared_ptr<const std::vector<uint8_t>> read_cached(archive&) const;
+    // like read_all, but on one of the archive's worker threads; the callback
+    // gets either the data or the exception that read_all threw, and is called
+    // on the worker thread; anything the callback itself throws is discarded
+    void read_async(archive&,
+                    std::function<void(std::vector<uint8_t>&&,
+                                       std::exception_ptr)> callback) const;
+    std::future<std::vector<uint8_t>> read_async(archive&) const;
+    // decompresses the whole file right now, building a seek index for it,
+    // so that later seeks within streams from open() are fast; does nothing
+    // for stored files, or if the file already has a complete index
+    void build_seek_index(archive&) const;
+    // hints to the OS that the file will be read soon, so it can start
+    // reading it in the background; or that it won't be needed again for a
+    // while, so it can drop the file's pages from memory (see
+    // archive::advise_sequential for when these do anything)
+    void will_need(archive&) const;
+    void dont_need(archive&) const;
   };
   // you should have only one of these per application, and it should be global
   // (so it doesn't gum up the heap or stack)
   class archive : std::unique_ptr<file[]> {
     friend class file;
-    std::mutex mutex;
-    std::istream stream;
-    uint32_t streampos;
+    friend struct stats_access;
+#ifdef TEZ_ENABLE_STATS
+    // what get_stats reports, kept up to date by the streambufs and friends;
+    // without TEZ_ENABLE_STATS, there's nothing here at all
+    struct counter_set {
+      std::atomic<uint64_t> bytes_read{0}, read_calls{0}, seeks{0};
+      std::atomic<uint64_t> lock_wait_ns{0}, decompress_ns{0}, crc_ns{0};
+      std::atomic<uint64_t> cache_hits{0}, cache_misses{0};
+      std::atomic<uint64_t> restarts{0}, checkpoint_restores{0};
+    };
+    counter_set counters;
+#endif
+    // a file we read a zipfile out of: the executable, or something mounted
+    // later; each one gets its own range of offsets, starting at base, so an
+    // offset says which source it's in as well as where
+    enum class advice { will_need, dont_need, sequential, random };
+    struct source {
+      uint64_t base, size;
+      // see mount; its files are [first_file, first_file + file_count)
+      int priority;
+      uint32_t first_file, file_count;
+      // only used when the file isn't mapped
+      std::mutex mutex;
+      std::istream stream;
+      uint64_t streampos;
+      // the whole file, if we managed to map it
+      const uint8_t* mapping;
+      size_t mapping_size;
+      // if the mapping is someone else's memory (see init_from_memory), which
+      // we must neither unmap nor drop pages from
+      bool borrowed;
+      // if we didn't, a file descriptor (or HANDLE) for positional reads, or
+      // -1
+      intptr_t raw_file;
+#if defined(WIN32) && defined(__GNUC__)
+      __gnu_cxx::stdio_filebuf buf;
+#else
+      std::filebuf buf;
+#endif
+      source() : base(0), size(0), priority(0), first_file(0), file_count(0),
+                 stream(&buf), streampos(0), mapping(nullptr),
+                 mapping_size(0), borrowed(false), raw_file(-1) {}
+      ~source() { unmap(); close_raw_file(); }
+      // once buf is open: finds the size, and maps the file or opens it for
+      // positional reads if we can
+#if defined(WIN32)
+      void attach(int fd);
+      void map(int fd);
+      void open_raw_file(int fd);
+#else
+      void attach(const std::string& path);
+      void map(const std::string& path);
+      void open_raw_file(const std::string& path);
+#endif
+      void unmap();
+      void close_raw_file();
+      // passes a hint about [offset, offset + length) of the file on to the
+      // OS, if we have a way to (length 0 means to the end)
+      void advise(uint64_t offset, uint64_t length, advice what) const;
+    };
+    // in order of base
+    std::vector<std::unique_ptr<source>> sources;
+    const source* source_for(uint64_t offset) const;
     // if your TEZ archives are big enough that a uint32_t can't hold the file
     // index anymore, you are officially doing something wrong
     uint32_t file_count;
-    std::unordered_map<std::string, uint32_t> file_map;
+    // all the filenames and comments, back to back, one arena per source
+    std::vector<std::unique_ptr<char[]>> strings;
+    // open addressing, linear probing, always at most half full; an index of
+    // NO_FILE marks an empty slot
+    struct name_slot {
+      uint32_t hash;
+      uint32_t index;
+    };
+    static constexpr uint32_t NO_FILE = 0xFFFFFFFF;
+    std::unique_ptr<name_slot[]> name_index;
+    uint32_t name_index_mask;
+    static uint32_t hash_name(string_view name) {
+      // FNV-1a
+      uint32_t hash = 2166136261u;
+      for(char c : name) {
+        hash ^= static_cast<uint8_t>(c);
+        hash *= 16777619u;
+      }
+      return hash;
+    }
+    void build_name_index();
+    // every directory that contains anything, whether or not it has an entry
+    // of its own, sorted by name; the root directory is ""
+    struct directory {
+      string_view name;
+      uint32_t first_child, child_count;
+    };
+    // the immediate children of each directory, sorted by name; index is
+    // NO_FILE for a directory that doesn't have its own entry
+    struct directory_child {
+      string_view name;
+      uint32_t index;
+    };
+    std::vector<directory> directories;
+    std::vector<directory_child> directory_children;
+    void build_directory_index();
+    const directory* find_directory(string_view name) const;
+    void glob(const directory& dir, string_view pattern,
+              std::vector<file*>& out) const;
+    uint32_t lookup(string_view filename) const {
+      if(!name_index) return NO_FILE;
+      uint32_t hash = hash_name(filename);
+      for(uint32_t i = hash & name_index_mask;; i = (i + 1) & name_index_mask) {
+        auto& slot = name_index[i];
+        if(slot.index == NO_FILE) return NO_FILE;
+        if(slot.hash == hash && get()[slot.index].get_filename() == filename)
+          return slot.index;
+      }
+    }
+    // seek indices for deflated files, by file index, built as files are
+    // read from beginning to end (see set_seek_index_spacing)
+    std::mutex seek_index_mutex;
+    std::unordered_map<uint32_t, std::shared_ptr<const seek_index>>
+      seek_indices;
+    std::atomic<uint32_t> seek_index_spacing;
+    // so we don't have to take the lock if there aren't any indices at all
+    std::atomic<uint32_t> seek_index_count;
+    // when to check CRCs (see init), and whether to check the CRCs of stored
+    // files at all (see set_verify_stored)
+    verify_policy verify;
+    std::atomic<bool> verify_stored;
+    // decompressed files, by file index, most recently used at the front of
+    // cache_lru; an entry whose data has other owners is pinned
+    struct cache_entry {
+      std::shared_ptr<const std::vector<uint8_t>> data;
+      std::list<uint32_t>::iterator lru;
+    };
+    std::mutex cache_mutex;
+    std::unordered_map<uint32_t, cache_entry> cache;
+    std::list<uint32_t> cache_lru;
+    std::atomic<size_t> cache_budget;
+    size_t cache_used;
+    // see set_parallel_inflate
+    std::atomic<uint64_t> parallel_threshold;
+    std::atomic<unsigned> parallel_threads;
+    std::shared_ptr<const std::vector<uint8_t>> cache_find(uint32_t fileno);
+    std::shared_ptr<const std::vector<uint8_t>>
+    cache_insert(uint32_t fileno, std::vector<uint8_t>&& data);
+    void cache_trim();
+    static void sort_by_position(std::vector<file*>& files);
+    // a budget of 0 turns the cache off, even for empty files
+    bool cache_wants(uint64_t size) const {
+      auto budget = cache_budget.load(std::memory_order_relaxed);
+      return budget != 0 && size <= budget;
+    }
+    // while tracing (see start_access_trace), the files that have been opened
+    // or read so far, in order, and which ones those are
+    std::atomic<bool> tracing;
+    std::mutex trace_mutex;
+    std::vector<uint32_t> trace;
+    std::vector<bool> traced;
+    void record_access(uint32_t fileno);
+    // inflaters that aren't being used right now, ready to go
+    std::mutex inflater_mutex;
+    std::vector<inflater_ptr> idle_inflaters;
+    // worker threads for read_async, started the first time they're needed
+    std::mutex async_mutex;
+    std::condition_variable async_wake;
+    std::deque<std::function<void()>> async_queue;
+    std::vector<std::thread> async_threads;
+    unsigned async_thread_count;
+    bool async_stopping;
+    void async_submit(std::function<void()> job);
+    void async_stop();
     std::unique_ptr<std::string> comment;
-#if defined(WIN32) && defined(__GNUC__)
-    __gnu_cxx::stdio_filebuf buf;
-#else
-    std::filebuf buf;
-#endif
-    uint32_t read_eocd(ssize_t);
-    void read_central_directory(uint32_t);
+    // reads the zipfile in a newly opened source, adding its files to the end
+    // of the archive; the source is dropped again if that fails
+    void add_source(std::unique_ptr<source> src, int priority,
+                    std::string* comment);
+    uint64_t read_eocd(const source& src, uint64_t& cd_size, uint64_t& count,
+                       std::string* comment);
+    void read_central_directory(source& src, uint64_t cd_offset,
+                                uint64_t cd_size, uint64_t count);
+    // loads src's files from the index embedded by tools/tez_index.cc, if it
+    // has one that matches its central directory and only uses methods this
+    // build can read; returns false otherwise
+    bool read_index(source& src, uint64_t cd_offset, uint64_t cd_size,
+                    uint64_t count);
+    std::unique_ptr<file[]> make_room(uint32_t count) const;
     using iterator_traits = std::iterator_traits<file*>;
   public:
-    void read_for_file(void* buffer, uint32_t offset, uint32_t length);
+    // the stored member that holds an embedded index, which is never one of
+    // the archive's files
+    static constexpr char INDEX_MEMBER_NAME[] = ".tez_index";
+    void read_for_file(void* buffer, uint64_t offset, size_t length);
+    // used by the deflate streambuf
+    std::shared_ptr<const seek_index> get_seek_index(uint32_t fileno);
+    void offer_seek_index(uint32_t fileno,
+                          std::shared_ptr<const seek_index> index);
+    // used by the deflate streambuf and read_all; a taken inflater is ready
+    // to start a new raw deflate stream
+    inflater_ptr take_inflater();
+    void give_back_inflater(inflater_ptr);
+    // returns nullptr if the executable isn't mapped
+    const uint8_t* map_for_file(uint64_t offset, uint64_t length) const;
+    // used by file::will_need and dont_need
+    void advise_range(uint64_t offset, uint64_t length, bool need) const;
+    // used by file's read methods
+    void note_access(uint32_t fileno) {
+      if(tracing.load(std::memory_order_relaxed)) record_access(fileno);
+    }
+    // a snapshot of the counters; see README.md for what they mean
+    struct stats {
+      uint64_t bytes_read, read_calls, seeks;
+      uint64_t lock_wait_ns, decompress_ns, crc_ns;
+      uint64_t cache_hits, cache_misses;
+      uint64_t restarts, checkpoint_restores;
+    };
     typedef file* iterator;
     typedef file* const_iterator;
     using reverse_iterator = std::reverse_iterator<iterator>;
     using const_reverse_iterator = std::reverse_iterator<const_iterator>;
     // you need to call init!
-    archive() : stream(&buf), streampos(0) {}
-    // initializes the archive
-    void init(const char* argv0);
+    archive() : file_count(0), seek_index_spacing(0), seek_index_count(0),
+                verify(verify_policy::always), verify_stored(false),
+                cache_budget(0), cache_used(0), parallel_threshold(0),
+                parallel_threads(0), tracing(false),
+                async_thread_count(0), async_stopping(false) {}
+    ~archive() { async_stop(); }
+    // initializes the archive; policy says when file::open, read_all and
+    // friends check CRCs
+    void init(const char* argv0,
+              verify_policy policy = verify_policy::always);
+    // initializes the archive from a zipfile that's already in memory (say,
+    // one linked into the executable with TEZ_EMBED_ZIPFILE), without opening
+    // any files; the memory must stay valid and unchanged until the archive
+    // is purged or destroyed
+    void init_from_memory(const void* data, size_t size,
+                          verify_policy policy = verify_policy::always);
+    // adds the files in another zipfile (say, a patch or a mod) to the
+    // archive, after the ones already there; when more than one layer has a
+    // file with the same name, lookups find the one from the layer with the
+    // highest priority (the executable's is 0), or the one mounted last if
+    // they tie; invalidates iterators and references to files, so don't call
+    // it while anyone else is using the archive
+    void mount(const std::string& path, int priority = 0);
     // frees all allocated memory for the archive
     void purge();
+    // if non-zero, streams from file::open() will remember where they were
+    // every this many bytes (or so) of decompressed data, as they read
+    // compressed files from beginning to end; later streams for the same file
+    // can then seek anywhere by decompressing at most this many bytes; each
+    // checkpoint costs up to 32KiB of memory
+    void set_seek_index_spacing(uint32_t spacing) {
+      seek_index_spacing.store(spacing, std::memory_order_relaxed);
+    }
+    // compressed files always have their CRCs checked once they've been read
+    // all the way through; if true, stored files are checked too: by read_all
+    // and data_view on every call, and by streams from file::open that read
+    // from the beginning to the end (a stream that skips over some of the
+    // file can't tell)
+    void set_verify_stored(bool enable) {
+      verify_stored.store(enable, std::memory_order_relaxed);
+    }
+    // how many worker threads to use for file::read_async (0, the default,
+    // means one per core); only takes effect before the first read_async, or
+    // after a purge
+    void set_async_threads(unsigned threads) {
+      std::unique_lock<std::mutex> lock(async_mutex);
+      async_thread_count = threads;
+    }
+    // if non-zero, compressed files are cached after being decompressed, and
+    // later calls to file::open, read_all, read_cached and data_view use the
+    // cached copy; the least recently used files are evicted when the cache
+    // grows larger than this many bytes, unless someone is still using them
+    void set_cache_budget(size_t bytes);
+    // if non-zero, read_all (and everything built on it) decompresses files
+    // at least this big on several threads at once (0 meaning one per core),
+    // when it can: a deflated file needs a seek index covering all of it (see
+    // file::build_seek_index), and a Zstandard file has to be in the seekable
+    // format
+    void set_parallel_inflate(uint64_t threshold, unsigned threads = 0) {
+      parallel_threshold.store(threshold, std::memory_order_relaxed);
+      parallel_threads.store(threads, std::memory_order_relaxed);
+    }
+    // all zero unless everything was compiled with TEZ_ENABLE_STATS; the
+    // counters are updated with relaxed atomics, so a snapshot taken while
+    // other threads are reading may be slightly inconsistent
+    stats get_stats() const;
+    void reset_stats();
+    // hints to the OS that the whole archive (every layer) will be read more
+    // or less from beginning to end, so it should read ahead aggressively, or
+    // in no particular order, so it shouldn't; only works if the file is
+    // mapped, or (except on Windows) read with positional reads
+    void advise_sequential();
+    void advise_random();
+    // starts recording which files are opened or read (by file::open,
+    // read_all, read_cached, data_view and read_async), for
+    // tools/tez_reorder.cc
+    void start_access_trace();
+    // stops recording, and returns each file that was opened or read since
+    // start_access_trace, once, in the order they were first accessed
+    std::vector<iterator> stop_access_trace();
     const std::string& get_comment() {
       if(!comment) comment = std::make_unique<std::string>();
       return *comment;
@@ -108,17 +586,43 @@ namespace TEZ {
         throw std::out_of_range("file index out of range");
       return begin()[index];
     }
-    auto& operator[](const std::string& filename) const {
-      auto it = file_map.find(filename);
-      if(it == file_map.end())
+    auto& operator[](string_view filename) const {
+      auto index = lookup(filename);
+      if(index == NO_FILE)
         throw std::out_of_range("file not found");
-      return (*this)[it->second];
+      return (*this)[index];
     }
-    auto find(const std::string& filename) const {
-      auto it = file_map.find(filename);
-      if(it == file_map.end()) return end();
-      return begin() + it->second;
+    auto find(string_view filename) const {
+      auto index = lookup(filename);
+      if(index == NO_FILE) return end();
+      return begin() + index;
     }
+    // returns the full paths of everything directly inside the given directory
+    // ("" for the root, "lang/" or "lang" for a subdirectory), whether or not
+    // the archive has explicit entries for the directories; subdirectories end
+    // with '/'
+    std::vector<string_view> list_directory(string_view path) const;
+    // returns every file whose path matches the pattern, where '*' matches
+    // any number of characters and '?' matches any one character, but neither
+    // matches '/' (e.g. "lang/*.utxt")
+    std::vector<iterator> glob(string_view pattern) const;
+    // decompresses all the given files into the cache (see set_cache_budget),
+    // using the given number of threads (0 for one per core), reading them in
+    // the order they're stored in the executable; files the cache wouldn't
+    // hold are skipped
+    void prefetch(const std::vector<iterator>& files, unsigned threads = 0);
+    // decompresses all the given files in the same way, each into the buffer
+    // returned by buffer_for, which must be at least get_uncompressed_size()
+    // bytes long (buffer_for may be called from any of the threads, but never
+    // from two at once)
+    void prefetch(const std::vector<iterator>& files, unsigned threads,
+                  const std::function<void*(const file&)>& buffer_for);
+    // used by tools/tez_index.cc: serializes the file table, names, and name
+    // and directory indices of an archive with a single layer, to be embedded
+    // in it as INDEX_MEMBER_NAME, right before a central directory whose
+    // first cd_size bytes (everything but the index's own record) have the
+    // given CRC
+    std::vector<uint8_t> serialize_index(uint64_t cd_size, uint32_t cd_crc);
   };
 }
 
@@ -127,4 +631,31 @@ namespace std {
     : public iterator_traits<TEZ::archive::iterator> {};
 }
 
+// TEZ_EMBED_ZIPFILE(name, "path/to/file.zip"), at namespace scope in one
+// source file, links the zipfile into the executable's read-only data as
+// name[], ending at name_end[], for archive::init_from_memory; the path is
+// looked up by the assembler, relative to the directory it runs in. Only for
+// GCC-compatible compilers targeting ELF or Mach-O; elsewhere, use a resource
+// or objcopy and pass its address and size to init_from_memory yourself.
+#if defined(__GNUC__) && (defined(__ELF__) || defined(__APPLE__))
+#if defined(__APPLE__)
+#define TEZ_ASM_SYMBOL(name) "_" #name
+#define TEZ_ASM_RODATA ".pushsection __TEXT,__const"
+#else
+#define TEZ_ASM_SYMBOL(name) #name
+#define TEZ_ASM_RODATA ".pushsection .rodata"
+#endif
+#define TEZ_EMBED_ZIPFILE(name, path) \
+  extern "C" const uint8_t name[]; \
+  extern "C" const uint8_t name##_end[]; \
+  __asm__(TEZ_ASM_RODATA "\n" \
+          ".globl " TEZ_ASM_SYMBOL(name) "\n" \
+          ".balign 16\n" \
+          TEZ_ASM_SYMBOL(name) ":\n" \
+          ".incbin \"" path "\"\n" \
+          ".globl " TEZ_ASM_SYMBOL(name##_end) "\n" \
+          TEZ_ASM_SYMBOL(name##_end) ":\n" \
+          ".popsection\n")
+#endif
+
 #endif
@@ -4,10 +4,47 @@
 #include <string.h>
 #include <assert.h>
 #include <algorithm>
+#include <thread>
 
 #if defined(WIN32)
 #define WIN32_LEAN_AND_MEAN
 #include <windows.h>
+#include <io.h>
+#endif
+
+// By default, TEZ maps the executable into memory. If that fails, it uses
+// positional reads (pread, or ReadFile with an OVERLAPPED offset), which don't
+// need a lock either. If that isn't possible, it reads through a single,
+// mutex-protected std::filebuf. Define TEZ_NO_MMAP and/or TEZ_NO_PREAD to skip
+// a method, or TEZ_USE_MMAP/TEZ_USE_PREAD/TEZ_USE_STREAM to pick just one.
+#ifdef TEZ_USE_MMAP
+#define TEZ_NO_PREAD
+#endif
+#ifdef TEZ_USE_PREAD
+#define TEZ_NO_MMAP
+#endif
+#ifdef TEZ_USE_STREAM
+#define TEZ_NO_MMAP
+#define TEZ_NO_PREAD
+#endif
+#if !defined(WIN32) && (!defined(TEZ_NO_MMAP) || !defined(TEZ_NO_PREAD))
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+#if !defined(WIN32) && !defined(TEZ_NO_MMAP)
+#include <sys/mman.h>
+#endif
+
+// Define TEZ_ENABLE_STATS, when compiling everything that includes tez.hh
+// (it changes archive's layout), to keep the counters that archive::get_stats
+// reports. Without it, archive has no counters at all, and counting costs
+// nothing.
+#ifdef TEZ_ENABLE_STATS
+#include <chrono>
+#define TEZ_COUNT(counter, amount) \
+  counters.counter.fetch_add((amount), std::memory_order_relaxed)
+#else
+#define TEZ_COUNT(counter, amount) ((void)0)
 #endif
 
 #ifndef TEZ_NO_PROC
@@ -29,22 +66,107 @@ namespace {
   constexpr int END_OF_CENTRAL_DIRECTORY_LEN = 22;
   constexpr int CENTRAL_DIRECTORY_RECORD_LEN = 46;
   constexpr int LOCAL_FILE_HEADER_LEN = 30;
+  constexpr int ZIP64_LOCATOR_LEN = 20;
+  constexpr int ZIP64_END_OF_CENTRAL_DIRECTORY_LEN = 56;
   constexpr uint16_t METHOD_STORE = 0;
   constexpr uint16_t METHOD_DEFLATE = 8;
+#ifdef TEZ_USE_ZSTD
+  constexpr uint16_t METHOD_ZSTD = 93;
+#endif
+  // whether this build can read members compressed with method
+  bool method_supported(uint16_t method) {
+    return method == METHOD_STORE || method == METHOD_DEFLATE
+#ifdef TEZ_USE_ZSTD
+      || method == METHOD_ZSTD
+#endif
+      ;
+  }
   inline uint32_t get_uint32(const uint8_t* p) {
     return p[0] |
       (uint32_t(p[1])<<8) |
       (uint32_t(p[2])<<16) |
       (uint32_t(p[3])<<24);
   }
+  inline uint64_t get_uint64(const uint8_t* p) {
+    return get_uint32(p) | (uint64_t(get_uint32(p+4))<<32);
+  }
   inline uint16_t get_uint16(const uint8_t* p) {
     return p[0] |
        (uint16_t(p[1])<<8);
   }
+  inline void put_uint16(uint8_t* p, uint16_t value) {
+    p[0] = static_cast<uint8_t>(value);
+    p[1] = static_cast<uint8_t>(value >> 8);
+  }
+  inline void put_uint32(uint8_t* p, uint32_t value) {
+    put_uint16(p, static_cast<uint16_t>(value));
+    put_uint16(p+2, static_cast<uint16_t>(value >> 16));
+  }
+  inline void put_uint64(uint8_t* p, uint64_t value) {
+    put_uint32(p, static_cast<uint32_t>(value));
+    put_uint32(p+4, static_cast<uint32_t>(value >> 32));
+  }
+  // An embedded index (see archive::serialize_index) is a header, the file
+  // records, the name index slots, the directories, their children, and the
+  // string arena, followed by a footer: its length (not counting the footer)
+  // and a magic number. The footer ends right where the central directory
+  // starts, so it's easy to find. Every position in a string is relative to
+  // the start of the arena. All numbers are little-endian.
+  constexpr uint64_t INDEX_MAGIC = 0x31584544494E5A54; // "TZINDEX1"
+  constexpr uint32_t INDEX_VERSION = 1;
+  // version, file count, central directory size (not counting the index's
+  // own record) and CRC, slot count, directory count, child count, arena size
+  constexpr int INDEX_HEADER_LEN = 40;
+  // offset, compressed size, uncompressed size, CRC, data skip, filename
+  // position, filename length, comment length, method, and two bytes of
+  // padding
+  constexpr int INDEX_FILE_LEN = 44;
+  // hash, index
+  constexpr int INDEX_SLOT_LEN = 8;
+  // name position, name length, first child, child count
+  constexpr int INDEX_DIRECTORY_LEN = 16;
+  // name position, name length, index
+  constexpr int INDEX_CHILD_LEN = 12;
+  constexpr int INDEX_FOOTER_LEN = 16;
+  // the directory containing a path, with its trailing slash ("" for the root)
+  TEZ::string_view parent_of(TEZ::string_view path) {
+    if(path.empty()) return path;
+    size_t n = path.size() - 1; // ignore a trailing slash
+    while(n > 0 && path[n-1] != '/') --n;
+    return path.substr(0, n);
+  }
+  // whether one path component matches a pattern component, see glob
+  bool wildcard_match(TEZ::string_view pattern, TEZ::string_view name) {
+    size_t p = 0, n = 0, star_p = TEZ::string_view::npos, star_n = 0;
+    while(n < name.size()) {
+      if(p < pattern.size() && pattern[p] == '*') {
+        star_p = p++;
+        star_n = n;
+      }
+      else if(p < pattern.size()
+              && (pattern[p] == '?' || pattern[p] == name[n])) {
+        ++p;
+        ++n;
+      }
+      else if(star_p != TEZ::string_view::npos) {
+        // let the last star eat one more character and try again
+        p = star_p + 1;
+        n = ++star_n;
+      }
+      else return false;
+    }
+    while(p < pattern.size() && pattern[p] == '*') ++p;
+    return p == pattern.size();
+  }
 }
 
-void TEZ::archive::init(const char* argv0) {
+void TEZ::archive::init(const char* argv0, verify_policy policy) {
   purge();
+  verify = policy;
+  auto src = std::make_unique<source>();
+  auto& buf = src->buf;
+  // the path we ended up opening, so we can map it later
+  std::string found_path;
 #if defined(WIN32)
   /* we can't use argv[0] on Windows for a number of reasons */
   (void)argv0;
@@ -70,29 +192,33 @@ void TEZ::archive::init(const char* argv0) {
   buf.open(fd);
 #else
   /* assuming a POSIX-like from here */
+  auto try_open = [&buf, &found_path](std::string path) {
+    if(buf.open(path, std::istream::in | std::istream::binary) != nullptr)
+      found_path = std::move(path);
+  };
 #ifndef TEZ_NO_PROC
   /* first, try various /proc-based methods */
 #ifndef TEZ_NO_PROC_SELF_EXE
   /* Linux */
   if(!buf.is_open())
-    buf.open("/proc/self/exe", std::istream::in | std::istream::binary);
+    try_open("/proc/self/exe");
 #endif
 #ifndef TEZ_NO_PROC_CURPROC_FILE
   /* Some BSDs*/
   if(!buf.is_open())
-    buf.open("/proc/curproc/file", std::istream::in | std::istream::binary);
+    try_open("/proc/curproc/file");
 #endif
 #ifndef TEZ_NO_PROC_CURPROC_EXE
   /* Other BSDs*/
   if(!buf.is_open())
-    buf.open("/proc/curproc/exe", std::istream::in | std::istream::binary);
+    try_open("/proc/curproc/exe");
 #endif
 #endif
   /* if that didn't work, let's look at argv0 */
   if(!buf.is_open() && argv0 != nullptr) {
     if(strchr(argv0, '/') != nullptr) {
       /* absolute or relative path, hopefully we didn't chdir */
-      buf.open(argv0, std::istream::in | std::istream::binary);
+      try_open(argv0);
     }
     else {
       /* bare exe name, let's search the PATH! YAY! */
@@ -104,15 +230,15 @@ void TEZ::archive::init(const char* argv0) {
           self_path.assign(path, p);
           self_path += '/';
           self_path += argv0;
-          if(buf.open(self_path, std::istream::in | std::istream::binary)
-             != nullptr) break;
+          try_open(self_path);
+          if(buf.is_open()) break;
           path = p+1;
         }
         if(!buf.is_open()) {
           self_path = path;
           self_path += '/';
           self_path += argv0;
-          buf.open(self_path, std::istream::in | std::istream::binary);
+          try_open(self_path);
         }
       }
     }
@@ -121,16 +247,36 @@ void TEZ::archive::init(const char* argv0) {
   if(!buf.is_open())
     throw std::system_error(errno, std::generic_category());
   try {
-    stream.exceptions(std::ifstream::failbit | std::ifstream::badbit | std::ifstream::eofbit);
-    stream.seekg(0, std::istream::end);
-    auto pos = stream.tellg();
-    if(pos < 0 || pos > 0xFFFFFFFF)
-      throw std::out_of_range("Zip64 is not implemented and this executable is too large");
-    ssize_t file_size = stream.tellg();
-    if(file_size != pos)
-      throw std::out_of_range("Zip64 is not implemented and this executable is too large");
-    auto cd_offset = read_eocd(file_size);
-    read_central_directory(cd_offset);
+#if defined(WIN32)
+    src->attach(fd);
+#else
+    src->attach(found_path);
+#endif
+    std::string comment;
+    add_source(std::move(src), 0, &comment);
+    this->comment = std::make_unique<std::string>(std::move(comment));
+  }
+  catch(...) {
+    purge();
+    throw;
+  }
+}
+
+void TEZ::archive::init_from_memory(const void* data, size_t size,
+                                    verify_policy policy) {
+  purge();
+  verify = policy;
+  // nothing to open: the "mapping" is all there is, so no other way of
+  // reading it ever comes into play
+  auto src = std::make_unique<source>();
+  src->size = size;
+  src->mapping = static_cast<const uint8_t*>(data);
+  src->mapping_size = size;
+  src->borrowed = true;
+  try {
+    std::string comment;
+    add_source(std::move(src), 0, &comment);
+    this->comment = std::make_unique<std::string>(std::move(comment));
   }
   catch(...) {
     purge();
@@ -138,69 +284,242 @@ void TEZ::archive::init(const char* argv0) {
   }
 }
 
+void TEZ::archive::mount(const std::string& path, int priority) {
+  auto src = std::make_unique<source>();
+#if defined(WIN32)
+  auto fd = _open(path.c_str(), _O_RDONLY | _O_BINARY);
+  if(fd < 0)
+    throw std::system_error(errno, std::generic_category());
+  src->buf.open(fd);
+  src->attach(fd);
+#else
+  if(src->buf.open(path, std::istream::in | std::istream::binary) == nullptr)
+    throw std::system_error(errno, std::generic_category());
+  src->attach(path);
+#endif
+  add_source(std::move(src), priority, nullptr);
+}
+
+// where is the file descriptor on Windows, and the path elsewhere
+#if defined(WIN32)
+void TEZ::archive::source::attach(int where) {
+#else
+void TEZ::archive::source::attach(const std::string& where) {
+#endif
+  stream.exceptions(std::ifstream::failbit | std::ifstream::badbit | std::ifstream::eofbit);
+  stream.seekg(0, std::istream::end);
+  auto pos = stream.tellg();
+  if(pos < 0)
+    throw std::runtime_error("could not find the size of the zipfile");
+  size = static_cast<uint64_t>(pos);
+  // that's where the stream is now
+  streampos = size;
+#ifndef TEZ_NO_MMAP
+  map(where);
+#endif
+#ifndef TEZ_NO_PREAD
+  if(mapping == nullptr) open_raw_file(where);
+#else
+  (void)where;
+#endif
+}
+
+void TEZ::archive::add_source(std::unique_ptr<source> src, int priority,
+                              std::string* comment) {
+  // offsets are 48 bits, see file::split
+  src->base = sources.empty() ? 0 : sources.back()->base + sources.back()->size;
+  if(src->base >> 48 != 0 || src->size >> 48 != 0
+     || (src->base + src->size) >> 48 != 0)
+    throw std::out_of_range("too many bytes of zipfiles mounted");
+  src->priority = priority;
+  sources.push_back(std::move(src));
+  auto& added = *sources.back();
+  bool indexed;
+  try {
+    uint64_t cd_size, count;
+    auto cd_offset = read_eocd(added, cd_size, count, comment);
+    indexed = read_index(added, cd_offset, cd_size, count);
+    if(!indexed) read_central_directory(added, cd_offset, cd_size, count);
+  }
+  catch(...) {
+    sources.pop_back();
+    throw;
+  }
+  // an index only has the name and directory indices for its own layer
+  if(!indexed || sources.size() > 1) {
+    build_name_index();
+    build_directory_index();
+  }
+}
+
 void TEZ::archive::purge() {
+  // let any outstanding read_asyncs finish first
+  async_stop();
+  sources.clear();
   file_count = 0;
   reset();
-  buf.close();
-  file_map.clear();
+  name_index.reset();
+  {
+    std::unique_lock<std::mutex> lock(seek_index_mutex);
+    seek_indices.clear();
+    seek_index_count.store(0, std::memory_order_relaxed);
+  }
+  {
+    std::unique_lock<std::mutex> lock(cache_mutex);
+    cache.clear();
+    cache_lru.clear();
+    cache_used = 0;
+  }
+  {
+    std::unique_lock<std::mutex> lock(inflater_mutex);
+    idle_inflaters.clear();
+  }
+  {
+    std::unique_lock<std::mutex> lock(trace_mutex);
+    tracing.store(false, std::memory_order_relaxed);
+    trace.clear();
+    traced.clear();
+  }
+  directories.clear();
+  directories.shrink_to_fit();
+  directory_children.clear();
+  directory_children.shrink_to_fit();
+  strings.clear();
   comment.reset();
-  stream.setstate(std::istream::goodbit);
 }
 
-uint32_t TEZ::archive::read_eocd(ssize_t file_size) {
+// returns the offset of the central directory, relative to the start of src
+uint64_t TEZ::archive::read_eocd(const source& src, uint64_t& cd_size,
+                                 uint64_t& count, std::string* comment) {
+  uint64_t file_size = src.size;
+  if(file_size < END_OF_CENTRAL_DIRECTORY_LEN)
+    throw std::out_of_range("file too small to possibly be a zipfile");
   int max_comment_len = 65535;
+  if(file_size - END_OF_CENTRAL_DIRECTORY_LEN < uint64_t(max_comment_len))
+    max_comment_len = static_cast<int>(file_size - END_OF_CENTRAL_DIRECTORY_LEN);
   // the position of the longest possible end of central directory record
-  auto seek_off = (file_size - max_comment_len) - END_OF_CENTRAL_DIRECTORY_LEN;
-  if(seek_off < 0) {
-    max_comment_len += seek_off;
-    seek_off = 0;
-  }
-  if(max_comment_len < 0)
-    throw std::out_of_range("executable too small to possibly be a zipfile");
-  stream.seekg(seek_off);
-  ssize_t buf_len = max_comment_len + END_OF_CENTRAL_DIRECTORY_LEN;
-  std::unique_ptr<uint8_t[]> buf = std::make_unique<uint8_t[]>(buf_len);
-  stream.read(reinterpret_cast<char*>(buf.get()), buf_len);
-  assert(stream.gcount() == buf_len);
+  uint64_t seek_off = file_size - max_comment_len - END_OF_CENTRAL_DIRECTORY_LEN;
+  size_t buf_len = max_comment_len + END_OF_CENTRAL_DIRECTORY_LEN;
+  std::unique_ptr<uint8_t[]> buf;
+  uint8_t tail[END_OF_CENTRAL_DIRECTORY_LEN];
+  const uint8_t* eocd_area = map_for_file(src.base + seek_off, buf_len);
+  if(eocd_area == nullptr) {
+    // almost no zipfile has a comment, which puts the record right at the
+    // end; try there before reading everywhere a comment could reach
+    read_for_file(tail, src.base + file_size - END_OF_CENTRAL_DIRECTORY_LEN,
+                  END_OF_CENTRAL_DIRECTORY_LEN);
+    if(get_uint32(tail) == 0x06054b50 && get_uint16(tail+20) == 0) {
+      max_comment_len = 0;
+      seek_off = file_size - END_OF_CENTRAL_DIRECTORY_LEN;
+      buf_len = END_OF_CENTRAL_DIRECTORY_LEN;
+      eocd_area = tail;
+    }
+  }
+  if(eocd_area == nullptr) {
+    buf = std::make_unique<uint8_t[]>(buf_len);
+    read_for_file(buf.get(), src.base + seek_off, buf_len);
+    eocd_area = buf.get();
+  }
   int comment_len;
   for(comment_len = 0; comment_len <= max_comment_len; ++comment_len) {
-    uint8_t* p = buf.get() + buf_len - comment_len - END_OF_CENTRAL_DIRECTORY_LEN;
+    const uint8_t* p = eocd_area + buf_len - comment_len - END_OF_CENTRAL_DIRECTORY_LEN;
     if(get_uint32(p) == 0x06054b50) break; // found it!
   }
   if(comment_len > max_comment_len)
-    throw std::runtime_error("executable does not appear to contain a zipfile");
-  uint8_t* p = buf.get() + buf_len - comment_len - END_OF_CENTRAL_DIRECTORY_LEN;
+    throw std::runtime_error("file does not appear to contain a zipfile");
+  const uint8_t* p = eocd_area + buf_len - comment_len - END_OF_CENTRAL_DIRECTORY_LEN;
+  uint64_t eocd_pos = seek_off + (p - eocd_area);
   if(std::find_if(p+4, p+8, [](uint8_t p) { return p != 0; }) != p+8) {
     throw std::out_of_range("multipart zipfiles are not supported");
   }
   // ignore the file count "on this disk"
-  file_count = get_uint16(p+10);
-  // allocate the needed number of entries
-  *static_cast<std::unique_ptr<file[]>*>(this)
-    = std::move(std::make_unique<file[]>(file_count));
-  // ignore central directory size
-  uint32_t cd_offset = get_uint32(p+16);
+  count = get_uint16(p+10);
+  cd_size = get_uint32(p+12);
+  uint64_t cd_offset = get_uint32(p+16);
   uint16_t comment_length = get_uint16(p+20);
-  comment = std::make_unique<std::string>(reinterpret_cast<char*>(p+22),
-                                          reinterpret_cast<char*>(p+22+comment_length));
+  if(comment_length > comment_len)
+    throw std::runtime_error("end of central directory record is corrupted");
+  if(comment != nullptr)
+    comment->assign(reinterpret_cast<const char*>(p+22),
+                    reinterpret_cast<const char*>(p+22+comment_length));
+  // a Zip64 archive has a locator right before the end of central directory
+  // record, pointing at a Zip64 end of central directory record, which has
+  // the real count, size and offset
+  if(eocd_pos >= ZIP64_LOCATOR_LEN) {
+    uint8_t locator[ZIP64_LOCATOR_LEN];
+    read_for_file(locator, src.base + eocd_pos - ZIP64_LOCATOR_LEN,
+                  ZIP64_LOCATOR_LEN);
+    if(get_uint32(locator) == 0x07064b50) {
+      if(get_uint32(locator+4) != 0 || get_uint32(locator+16) > 1)
+        throw std::out_of_range("multipart zipfiles are not supported");
+      uint64_t record_pos = get_uint64(locator+8);
+      uint8_t record[ZIP64_END_OF_CENTRAL_DIRECTORY_LEN];
+      if(record_pos > eocd_pos - ZIP64_LOCATOR_LEN
+         || eocd_pos - ZIP64_LOCATOR_LEN - record_pos
+         < ZIP64_END_OF_CENTRAL_DIRECTORY_LEN)
+        throw std::runtime_error("Zip64 end of central directory record is corrupted");
+      read_for_file(record, src.base + record_pos,
+                    ZIP64_END_OF_CENTRAL_DIRECTORY_LEN);
+      if(get_uint32(record) != 0x06064b50)
+        throw std::runtime_error("Zip64 end of central directory record is corrupted");
+      if(get_uint32(record+16) != 0 || get_uint32(record+20) != 0)
+        throw std::out_of_range("multipart zipfiles are not supported");
+      count = get_uint64(record+32);
+      cd_size = get_uint64(record+40);
+      cd_offset = get_uint64(record+48);
+    }
+  }
+  // every file takes at least a fixed-size record, so a count the central
+  // directory can't hold is corruption, not a reason to allocate that much
+  if(count > cd_size / CENTRAL_DIRECTORY_RECORD_LEN)
+    throw std::runtime_error("central directory is corrupted");
+  // NO_FILE must never be a valid index, even counting every layer
+  if(count >= NO_FILE - file_count)
+    throw std::out_of_range("zipfile has too many files");
   return cd_offset;
 }
 
-void TEZ::archive::read_central_directory(uint32_t cd_offset) {
-  stream.seekg(cd_offset);
-  std::unique_ptr<std::string[]> filenames = std::make_unique<std::string[]>(file_count);
-  // fileno can't overflow, file_count will not be >65535
-  for(uint32_t fileno = 0; fileno < file_count; ++fileno) {
-    auto& file = get()[fileno];
-    uint8_t buf[CENTRAL_DIRECTORY_RECORD_LEN];
-    stream.read(reinterpret_cast<char*>(buf), CENTRAL_DIRECTORY_RECORD_LEN);
-    assert(stream.gcount() == CENTRAL_DIRECTORY_RECORD_LEN);
+// adds src's files to the end of the archive, leaving the archive alone if
+// anything goes wrong
+void TEZ::archive::read_central_directory(source& src, uint64_t cd_offset,
+                                          uint64_t cd_size, uint64_t count) {
+  if(cd_size > SIZE_MAX || cd_offset > src.size
+     || cd_size > src.size - cd_offset)
+    throw std::runtime_error("central directory is corrupted");
+  // read (or map) the whole thing in one go, then pick it apart in memory
+  std::unique_ptr<uint8_t[]> cd_buf;
+  const uint8_t* cd = map_for_file(src.base + cd_offset, cd_size);
+  if(cd == nullptr) {
+    cd_buf = std::make_unique<uint8_t[]>(cd_size);
+    read_for_file(cd_buf.get(), src.base + cd_offset, cd_size);
+    cd = cd_buf.get();
+  }
+  const uint8_t* cd_end = cd + cd_size;
+  // every name and comment comes out of the central directory, so it's
+  // certainly big enough to hold all of them
+  auto arena = std::make_unique<char[]>(cd_size);
+  char* next_string = arena.get();
+  uint32_t first_file = file_count;
+  auto files = make_room(static_cast<uint32_t>(count));
+  // fileno can't overflow, file_count + count is less than NO_FILE
+  uint32_t fileno = first_file;
+  for(uint64_t n = 0; n < count; ++n) {
+    auto& file = files[fileno];
+    if(cd_end - cd < CENTRAL_DIRECTORY_RECORD_LEN)
+      throw std::runtime_error("central directory is corrupted");
+    const uint8_t* buf = cd;
     if(get_uint32(buf) != 0x02014b50)
       throw std::runtime_error("central directory is corrupted");
     // ignore version made by
-    // version needed to extract
-    if(get_uint16(buf+6) > 20)
-      throw std::out_of_range("zipfile is not PKZIP 2.0 compatible");
+    // version needed to extract (4.5 is the first version with Zip64, 6.3
+    // the first with Zstandard)
+#ifdef TEZ_USE_ZSTD
+    if(get_uint16(buf+6) > 63)
+      throw std::out_of_range("zipfile needs features newer than Zstandard");
+#else
+    if(get_uint16(buf+6) > 45)
+      throw std::out_of_range("zipfile needs features newer than Zip64");
+#endif
     uint16_t general_bitflag = get_uint16(buf+8);
     if(general_bitflag & 1)
       throw std::out_of_range("zipfile contains an encrypted member");
@@ -209,63 +528,1001 @@ void TEZ::archive::read_central_directory(uint32_t cd_offset) {
     else if(general_bitflag & 0xF7F0)
       throw std::out_of_range("zipfile member uses unsupported GPBF flags");
     file.method = get_uint16(buf+10);
-    if(file.method != METHOD_STORE && file.method != METHOD_DEFLATE)
+    if(!method_supported(file.method)) {
+#ifdef TEZ_USE_ZSTD
+      throw std::out_of_range("zipfile uses a compression method other than deflate or zstd");
+#else
       throw std::out_of_range("zipfile uses a compression method other than deflate");
+#endif
+    }
     // skip modification time and date
     file.crc32 = get_uint32(buf+16);
-    file.compressed_size = get_uint32(buf+20);
-    file.uncompressed_size = get_uint32(buf+24);
+    uint64_t compressed_size = get_uint32(buf+20);
+    uint64_t uncompressed_size = get_uint32(buf+24);
     uint16_t filename_length = get_uint16(buf+28);
     uint16_t extra_length = get_uint16(buf+30);
     uint16_t comment_length = get_uint16(buf+32);
-    uint16_t disk_number = get_uint16(buf+34);
+    uint32_t disk_number = get_uint16(buf+34);
+    // ignore internal and external file attributes
+    uint64_t offset = get_uint32(buf+42);
+    cd += CENTRAL_DIRECTORY_RECORD_LEN;
+    if(cd_end - cd < filename_length + extra_length + comment_length)
+      throw std::runtime_error("central directory is corrupted");
+    memcpy(next_string, cd, filename_length);
+    file.filename = next_string;
+    file.filename_length = filename_length;
+    next_string += filename_length;
+    cd += filename_length;
+    // any field that didn't fit is in the Zip64 extra field, in this order
+    for(const uint8_t* extra = cd; extra + 4 <= cd + extra_length;) {
+      uint16_t id = get_uint16(extra);
+      uint16_t length = get_uint16(extra+2);
+      const uint8_t* field = extra + 4;
+      const uint8_t* field_end = field + length;
+      if(field_end > cd + extra_length)
+        throw std::runtime_error("central directory is corrupted");
+      if(id == 0x0001) {
+        auto take = [&](uint64_t& value, int width) {
+          if(field_end - field < width)
+            throw std::runtime_error("central directory is corrupted");
+          value = width == 8 ? get_uint64(field) : get_uint32(field);
+          field += width;
+        };
+        if(uncompressed_size == 0xFFFFFFFF) take(uncompressed_size, 8);
+        if(compressed_size == 0xFFFFFFFF) take(compressed_size, 8);
+        if(offset == 0xFFFFFFFF) take(offset, 8);
+        if(disk_number == 0xFFFF) {
+          uint64_t disk;
+          take(disk, 4);
+          disk_number = static_cast<uint32_t>(disk);
+        }
+        break;
+      }
+      extra = field_end;
+    }
     if(disk_number > 0)
       throw std::out_of_range("multipart zipfiles are not supported");
-    // ignore internal and external file attributes
-    file.offset = get_uint32(buf+42);
-    auto& filename = filenames[fileno];
-    filename.resize(filename_length);
-    stream.read(const_cast<char*>(filename.data()), filename_length);
-    assert(stream.gcount() == filename_length);
-    stream.seekg(extra_length, std::istream::cur);
-    comment = std::make_unique<std::string>();
-    comment->resize(comment_length);
-    stream.read(const_cast<char*>(comment->data()), comment_length);
-    assert(stream.gcount() == comment_length);
-  }
-  file_map.reserve(file_count);
+    file::split(compressed_size, file.compressed_size_high,
+                file.compressed_size_low);
+    file::split(uncompressed_size, file.uncompressed_size_high,
+                file.uncompressed_size_low);
+    file::split(src.base + offset, file.offset_high, file.offset_low);
+    if(file.method == METHOD_STORE && compressed_size != uncompressed_size)
+      throw std::runtime_error("central directory is corrupted");
+    cd += extra_length;
+    // the comment must come right after the filename, see file::get_comment
+    memcpy(next_string, cd, comment_length);
+    file.comment_length = comment_length;
+    next_string += comment_length;
+    cd += comment_length;
+    // the index (see read_index) is never one of the files, even when it's
+    // stale, so its slot gets reused
+    if(file.get_filename() == INDEX_MEMBER_NAME) continue;
+    ++fileno;
+  }
+  *static_cast<std::unique_ptr<TEZ::file[]>*>(this) = std::move(files);
+  file_count = fileno;
+  strings.emplace_back(std::move(arena));
+  src.first_file = first_file;
+  src.file_count = fileno - first_file;
+  // local file headers are read lazily, by file::get_data_offset
+}
+
+constexpr char TEZ::archive::INDEX_MEMBER_NAME[];
+
+bool TEZ::archive::read_index(source& src, uint64_t cd_offset,
+                              uint64_t cd_size, uint64_t count) {
+  // anything that doesn't add up means there's no (usable) index, and we
+  // parse the central directory as usual
+  if(cd_offset < INDEX_FOOTER_LEN || cd_offset > src.size
+     || cd_size > src.size - cd_offset || cd_size > SIZE_MAX || count == 0)
+    return false;
+  uint8_t footer[INDEX_FOOTER_LEN];
+  read_for_file(footer, src.base + cd_offset - INDEX_FOOTER_LEN,
+                INDEX_FOOTER_LEN);
+  if(get_uint64(footer+8) != INDEX_MAGIC) return false;
+  uint64_t index_len = get_uint64(footer);
+  if(index_len < INDEX_HEADER_LEN
+     || index_len > cd_offset - INDEX_FOOTER_LEN || index_len > SIZE_MAX)
+    return false;
+  uint64_t index_pos = cd_offset - INDEX_FOOTER_LEN - index_len;
+  // the whole index (and the footer) is the member's data, and has to stay
+  // around, since the names point into it
+  std::unique_ptr<char[]> index_buf;
+  size_t member_len = static_cast<size_t>(index_len) + INDEX_FOOTER_LEN;
+  auto member = map_for_file(src.base + index_pos, member_len);
+  if(member == nullptr) {
+    index_buf = std::make_unique<char[]>(member_len);
+    read_for_file(index_buf.get(), src.base + index_pos, member_len);
+    member = reinterpret_cast<const uint8_t*>(index_buf.get());
+  }
+  const uint8_t* p = member;
+  uint32_t version = get_uint32(p);
+  uint32_t indexed_count = get_uint32(p+4);
+  uint64_t indexed_cd_size = get_uint64(p+8);
+  uint32_t cd_crc = get_uint32(p+16);
+  uint32_t slot_count = get_uint32(p+20);
+  uint32_t directory_count = get_uint32(p+24);
+  uint32_t child_count = get_uint32(p+28);
+  uint64_t strings_len = get_uint64(p+32);
+  // the index describes every member but itself
+  if(version != INDEX_VERSION || indexed_count != count - 1
+     || indexed_cd_size >= cd_size
+     || INDEX_HEADER_LEN + uint64_t(indexed_count) * INDEX_FILE_LEN
+     + uint64_t(slot_count) * INDEX_SLOT_LEN
+     + uint64_t(directory_count) * INDEX_DIRECTORY_LEN
+     + uint64_t(child_count) * INDEX_CHILD_LEN + strings_len != index_len
+     || (slot_count & (slot_count - 1)) != 0
+     || (slot_count == 0) != (indexed_count == 0))
+    return false;
+  // the index's own record comes last, and everything before it has to be
+  // exactly what the index was built from
+  std::unique_ptr<uint8_t[]> cd_buf;
+  const uint8_t* cd = map_for_file(src.base + cd_offset, cd_size);
+  if(cd == nullptr) {
+    cd_buf = std::make_unique<uint8_t[]>(cd_size);
+    read_for_file(cd_buf.get(), src.base + cd_offset, cd_size);
+    cd = cd_buf.get();
+  }
+  const uint8_t* record = cd + indexed_cd_size;
+  size_t name_len = strlen(INDEX_MEMBER_NAME);
+  if(cd_size - indexed_cd_size < CENTRAL_DIRECTORY_RECORD_LEN + name_len
+     || get_uint32(record) != 0x02014b50
+     || get_uint16(record+10) != METHOD_STORE
+     || get_uint16(record+28) != name_len
+     || CENTRAL_DIRECTORY_RECORD_LEN + name_len + get_uint16(record+30)
+     + get_uint16(record+32) != cd_size - indexed_cd_size
+     || memcmp(record + CENTRAL_DIRECTORY_RECORD_LEN, INDEX_MEMBER_NAME,
+               name_len) != 0
+     || get_uint32(record+16) != crc32_update(0, member, member_len)
+     || crc32_update(0, cd, static_cast<size_t>(indexed_cd_size)) != cd_crc)
+    return false;
+  // it's the real thing, so from here on, anything wrong is corruption
+  auto corrupted = []() {
+    return std::runtime_error("embedded index is corrupted");
+  };
+  const char* strings_start = reinterpret_cast<const char*>(member)
+    + (index_len - strings_len);
+  auto get_string = [&](const uint8_t* p) {
+    uint32_t pos = get_uint32(p), len = get_uint32(p+4);
+    if(pos > strings_len || len > strings_len - pos) throw corrupted();
+    return string_view(strings_start + pos, len);
+  };
+  uint32_t first_file = file_count;
+  // only the first layer can use the index's name and directory indices as
+  // they are, later ones get merged with the layers below them
+  bool first_layer = first_file == 0;
+  auto files = make_room(indexed_count);
+  p += INDEX_HEADER_LEN;
+  for(uint32_t n = 0; n < indexed_count; ++n, p += INDEX_FILE_LEN) {
+    auto& file = files[first_file + n];
+    uint64_t offset = get_uint64(p);
+    if(offset > src.size) throw corrupted();
+    file::split(src.base + offset, file.offset_high, file.offset_low);
+    file::split(get_uint64(p+8), file.compressed_size_high,
+                file.compressed_size_low);
+    file::split(get_uint64(p+16), file.uncompressed_size_high,
+                file.uncompressed_size_low);
+    file.crc32 = get_uint32(p+24);
+    // a set VERIFIED bit would skip checks the index can't vouch for
+    uint32_t data_skip = get_uint32(p+28);
+    if(data_skip & file::VERIFIED) throw corrupted();
+    file.data_skip.store(data_skip, std::memory_order_relaxed);
+    file.filename_length = get_uint16(p+36);
+    file.comment_length = get_uint16(p+38);
+    uint32_t filename_pos = get_uint32(p+32);
+    if(filename_pos > strings_len
+       || uint64_t(file.filename_length) + file.comment_length
+       > strings_len - filename_pos)
+      throw corrupted();
+    file.filename = strings_start + filename_pos;
+    file.method = get_uint16(p+40);
+    // the index may have come from a build that reads more methods than
+    // this one; let the central directory say so the usual way
+    if(!method_supported(file.method)) return false;
+    if(file.method == METHOD_STORE
+       && file.get_compressed_size() != file.get_uncompressed_size())
+      throw corrupted();
+  }
+  std::unique_ptr<name_slot[]> slots;
+  std::vector<directory> dirs;
+  std::vector<directory_child> children;
+  if(first_layer && slot_count != 0) {
+    slots = std::make_unique<name_slot[]>(slot_count);
+    for(uint32_t n = 0; n < slot_count; ++n, p += INDEX_SLOT_LEN) {
+      slots[n].hash = get_uint32(p);
+      slots[n].index = get_uint32(p+4);
+      if(slots[n].index >= indexed_count && slots[n].index != NO_FILE)
+        throw corrupted();
+    }
+    dirs.reserve(directory_count);
+    for(uint32_t n = 0; n < directory_count; ++n, p += INDEX_DIRECTORY_LEN) {
+      uint32_t first = get_uint32(p+8), count = get_uint32(p+12);
+      if(first > child_count || count > child_count - first)
+        throw corrupted();
+      dirs.push_back(directory{get_string(p), first, count});
+    }
+    children.reserve(child_count);
+    for(uint32_t n = 0; n < child_count; ++n, p += INDEX_CHILD_LEN) {
+      uint32_t index = get_uint32(p+8);
+      if(index >= indexed_count && index != NO_FILE) throw corrupted();
+      children.push_back(directory_child{get_string(p), index});
+    }
+  }
+  // all good, we can commit
+  *static_cast<std::unique_ptr<TEZ::file[]>*>(this) = std::move(files);
+  file_count = first_file + indexed_count;
+  src.first_file = first_file;
+  src.file_count = indexed_count;
+  if(index_buf) strings.emplace_back(std::move(index_buf));
+  if(first_layer && slot_count != 0) {
+    name_index = std::move(slots);
+    name_index_mask = slot_count - 1;
+    directories = std::move(dirs);
+    directory_children = std::move(children);
+  }
+  return true;
+}
+
+std::vector<uint8_t> TEZ::archive::serialize_index(uint64_t cd_size,
+                                                   uint32_t cd_crc) {
+  if(sources.size() != 1)
+    throw std::logic_error("only an archive with one layer can be indexed");
+  // a fresh arena, since the names might not be in one already; every name
+  // in the directory index is a prefix of some file's name
+  std::string arena;
+  std::unordered_map<const char*, uint32_t> string_pos;
+  for(auto& f : *this) {
+    string_pos.emplace(f.filename, static_cast<uint32_t>(arena.size()));
+    arena.append(f.filename, f.filename_length + f.comment_length);
+  }
+  if(arena.size() > 0xFFFFFFFF)
+    throw std::length_error("too many names to index");
+  auto put_string = [&](uint8_t* p, string_view name) {
+    if(name.empty()) put_uint32(p, 0);
+    else put_uint32(p, string_pos.at(name.data()));
+    put_uint32(p+4, static_cast<uint32_t>(name.size()));
+  };
+  uint32_t slot_count = file_count == 0 ? 0 : name_index_mask + 1;
+  std::vector<uint8_t> ret(INDEX_HEADER_LEN
+                           + size_t(file_count) * INDEX_FILE_LEN
+                           + size_t(slot_count) * INDEX_SLOT_LEN
+                           + directories.size() * INDEX_DIRECTORY_LEN
+                           + directory_children.size() * INDEX_CHILD_LEN
+                           + arena.size() + INDEX_FOOTER_LEN);
+  uint8_t* p = ret.data();
+  put_uint32(p, INDEX_VERSION);
+  put_uint32(p+4, file_count);
+  put_uint64(p+8, cd_size);
+  put_uint32(p+16, cd_crc);
+  put_uint32(p+20, slot_count);
+  put_uint32(p+24, static_cast<uint32_t>(directories.size()));
+  put_uint32(p+28, static_cast<uint32_t>(directory_children.size()));
+  put_uint64(p+32, arena.size());
+  p += INDEX_HEADER_LEN;
+  for(auto& f : *this) {
+    uint64_t data_offset = f.get_data_offset(*this);
+    put_uint64(p, f.get_offset());
+    put_uint64(p+8, f.get_compressed_size());
+    put_uint64(p+16, f.get_uncompressed_size());
+    put_uint32(p+24, f.crc32);
+    put_uint32(p+28, static_cast<uint32_t>(data_offset - f.get_offset()));
+    put_uint32(p+32, string_pos.at(f.filename));
+    put_uint16(p+36, f.filename_length);
+    put_uint16(p+38, f.comment_length);
+    put_uint16(p+40, f.method);
+    put_uint16(p+42, 0);
+    p += INDEX_FILE_LEN;
+  }
+  for(uint32_t n = 0; n < slot_count; ++n, p += INDEX_SLOT_LEN) {
+    put_uint32(p, name_index[n].hash);
+    put_uint32(p+4, name_index[n].index);
+  }
+  for(auto& dir : directories) {
+    put_string(p, dir.name);
+    put_uint32(p+8, dir.first_child);
+    put_uint32(p+12, dir.child_count);
+    p += INDEX_DIRECTORY_LEN;
+  }
+  for(auto& child : directory_children) {
+    put_string(p, child.name);
+    put_uint32(p+8, child.index);
+    p += INDEX_CHILD_LEN;
+  }
+  memcpy(p, arena.data(), arena.size());
+  p += arena.size();
+  put_uint64(p, ret.size() - INDEX_FOOTER_LEN);
+  put_uint64(p+8, INDEX_MAGIC);
+  return ret;
+}
+
+// a copy of the file table with room for count more files on the end; the
+// files already there keep their indices (caches and seek indices depend on
+// them)
+std::unique_ptr<TEZ::file[]> TEZ::archive::make_room(uint32_t count) const {
+  auto files = std::make_unique<TEZ::file[]>(file_count + count);
+  for(uint32_t fileno = 0; fileno < file_count; ++fileno) {
+    auto& from = get()[fileno];
+    auto& to = files[fileno];
+    to.offset_low = from.offset_low;
+    to.data_skip.store(from.data_skip.load(std::memory_order_relaxed),
+                       std::memory_order_relaxed);
+    to.crc32 = from.crc32;
+    to.compressed_size_low = from.compressed_size_low;
+    to.uncompressed_size_low = from.uncompressed_size_low;
+    to.offset_high = from.offset_high;
+    to.compressed_size_high = from.compressed_size_high;
+    to.uncompressed_size_high = from.uncompressed_size_high;
+    to.filename_length = from.filename_length;
+    to.comment_length = from.comment_length;
+    to.method = from.method;
+    to.filename = from.filename;
+  }
+  return files;
+}
+
+void TEZ::archive::build_name_index() {
+  // smallest power of two that's at least twice the file count
+  uint32_t slot_count = 1;
+  while(slot_count < uint64_t(file_count) * 2) slot_count <<= 1;
+  name_index = std::make_unique<name_slot[]>(slot_count);
+  name_index_mask = slot_count - 1;
+  std::fill(name_index.get(), name_index.get() + slot_count,
+            name_slot{0, NO_FILE});
+  // go through the layers from the one that wins to the one that loses
+  // (highest priority first, and most recently mounted first among equals),
+  // so that the first file we see with a given name is the one that should
+  // win
+  std::vector<const source*> layers;
+  for(auto it = sources.rbegin(); it != sources.rend(); ++it)
+    layers.push_back(it->get());
+  std::stable_sort(layers.begin(), layers.end(),
+                   [](const source* a, const source* b) {
+                     return a->priority > b->priority;
+                   });
+  for(auto src : layers) {
+    uint32_t end = src->first_file + src->file_count;
+    for(uint32_t fileno = src->first_file; fileno < end; ++fileno) {
+      auto filename = get()[fileno].get_filename();
+      uint32_t hash = hash_name(filename);
+      for(uint32_t i = hash & name_index_mask;;
+          i = (i + 1) & name_index_mask) {
+        auto& slot = name_index[i];
+        if(slot.index == NO_FILE) {
+          slot.hash = hash;
+          slot.index = fileno;
+          break;
+        }
+        // if a name appears more than once in a layer, the first one wins
+        if(slot.hash == hash && get()[slot.index].get_filename() == filename)
+          break;
+      }
+    }
+  }
+}
+
+void TEZ::archive::build_directory_index() {
+  struct entry {
+    string_view parent;
+    directory_child child;
+  };
+  directories.clear();
+  directory_children.clear();
+  std::vector<entry> entries;
+  entries.reserve(file_count);
   for(uint32_t fileno = 0; fileno < file_count; ++fileno) {
-    file_map.emplace(std::move(filenames[fileno]), fileno);
+    string_view path = get()[fileno].get_filename();
+    if(path.empty()) continue;
+    string_view parent = parent_of(path);
+    // whichever file the name index picked, when layers overlap
+    entries.push_back(entry{parent, directory_child{path, lookup(path)}});
+    // make sure every containing directory is in there too, even if the
+    // archive doesn't have an entry for it
+    while(!parent.empty()) {
+      path = parent;
+      parent = parent_of(path);
+      entries.push_back(entry{parent, directory_child{path, NO_FILE}});
+    }
+  }
+  // sorting puts each directory's children together, and, for duplicate
+  // paths, puts the real entry first (NO_FILE sorts last)
+  std::sort(entries.begin(), entries.end(),
+            [](const entry& a, const entry& b) {
+              int c = a.parent.compare(b.parent);
+              if(c != 0) return c < 0;
+              c = a.child.name.compare(b.child.name);
+              if(c != 0) return c < 0;
+              return a.child.index < b.child.index;
+            });
+  entries.erase(std::unique(entries.begin(), entries.end(),
+                            [](const entry& a, const entry& b) {
+                              return a.child.name == b.child.name;
+                            }), entries.end());
+  directory_children.reserve(entries.size());
+  for(auto& e : entries) {
+    if(directories.empty() || directories.back().name != e.parent) {
+      directories.push_back(directory{e.parent,
+            static_cast<uint32_t>(directory_children.size()), 0});
+    }
+    ++directories.back().child_count;
+    directory_children.push_back(e.child);
+  }
+}
+
+const TEZ::archive::directory*
+TEZ::archive::find_directory(string_view name) const {
+  auto it = std::lower_bound(directories.begin(), directories.end(), name,
+                             [](const directory& a, string_view b) {
+                               return a.name < b;
+                             });
+  if(it == directories.end() || it->name != name) return nullptr;
+  return &*it;
+}
+
+std::vector<TEZ::string_view>
+TEZ::archive::list_directory(string_view path) const {
+  std::vector<string_view> ret;
+  const directory* dir;
+  if(!path.empty() && path.back() != '/') {
+    // directory names always have the trailing slash
+    std::string slashed(path);
+    slashed += '/';
+    dir = find_directory(slashed);
+  }
+  else dir = find_directory(path);
+  if(dir == nullptr) return ret;
+  ret.reserve(dir->child_count);
+  for(uint32_t n = 0; n < dir->child_count; ++n)
+    ret.push_back(directory_children[dir->first_child + n].name);
+  return ret;
+}
+
+std::vector<TEZ::archive::iterator>
+TEZ::archive::glob(string_view pattern) const {
+  std::vector<iterator> ret;
+  auto root = find_directory(string_view());
+  if(root != nullptr) glob(*root, pattern, ret);
+  return ret;
+}
+
+void TEZ::archive::glob(const directory& dir, string_view pattern,
+                        std::vector<file*>& out) const {
+  // the first component of the pattern, including its slash if it has one
+  size_t slash = 0;
+  while(slash < pattern.size() && pattern[slash] != '/') ++slash;
+  bool is_last = slash == pattern.size() || slash == pattern.size() - 1;
+  string_view component = pattern.substr(0, slash);
+  string_view rest = pattern.substr(slash == pattern.size() ? slash : slash+1);
+  bool wants_directory = slash < pattern.size();
+  auto visit = [&](const directory_child& child) {
+    if(is_last) {
+      if(child.index != NO_FILE) out.push_back(get() + child.index);
+    }
+    else {
+      auto subdir = find_directory(child.name);
+      if(subdir != nullptr) glob(*subdir, rest, out);
+    }
+  };
+  auto first = directory_children.begin() + dir.first_child;
+  auto last = first + dir.child_count;
+  if(std::find_if(component.begin(), component.end(), [](char c) {
+        return c == '*' || c == '?';
+      }) == component.end()) {
+    // no wildcards, so there's at most one match, and the children are sorted,
+    // so we can go straight to it
+    string_view key = pattern.substr(0, wants_directory ? slash + 1 : slash);
+    auto it = std::lower_bound(first, last, key,
+                               [&](const directory_child& a, string_view b) {
+                                 return a.name.substr(dir.name.size()) < b;
+                               });
+    if(it != last && it->name.substr(dir.name.size()) == key) visit(*it);
+  }
+  else {
+    for(auto it = first; it != last; ++it) {
+      string_view leaf = it->name.substr(dir.name.size());
+      bool is_directory = leaf.back() == '/';
+      if(is_directory != wants_directory) continue;
+      if(is_directory) leaf = leaf.substr(0, leaf.size() - 1);
+      if(wildcard_match(component, leaf)) visit(*it);
+    }
+  }
+}
+
+#ifndef TEZ_NO_MMAP
+#if defined(WIN32)
+void TEZ::archive::source::map(int fd) {
+  // too big for our address space? we'll have to read it instead
+  if(size > SIZE_MAX) return;
+  HANDLE file = reinterpret_cast<HANDLE>(_get_osfhandle(fd));
+  if(file == INVALID_HANDLE_VALUE) return;
+  HANDLE map = CreateFileMappingW(file, nullptr, PAGE_READONLY, 0, 0, nullptr);
+  if(map == nullptr) return;
+  void* view = MapViewOfFile(map, FILE_MAP_READ, 0, 0, 0);
+  // the view keeps the mapping object alive
+  CloseHandle(map);
+  if(view == nullptr) return;
+  mapping = reinterpret_cast<const uint8_t*>(view);
+  mapping_size = size;
+}
+#else
+void TEZ::archive::source::map(const std::string& path) {
+  // too big for our address space? we'll have to read it instead
+  if(path.empty() || size == 0 || size > SIZE_MAX) return;
+  int fd = ::open(path.c_str(), O_RDONLY);
+  if(fd < 0) return;
+  void* view = mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0);
+  // the mapping keeps the file alive
+  close(fd);
+  if(view == MAP_FAILED) return;
+  mapping = reinterpret_cast<const uint8_t*>(view);
+  mapping_size = size;
+}
+#endif
+#endif
+
+void TEZ::archive::source::unmap() {
+  if(mapping == nullptr) return;
+#ifndef TEZ_NO_MMAP
+  if(!borrowed) {
+#if defined(WIN32)
+    UnmapViewOfFile(mapping);
+#else
+    munmap(const_cast<uint8_t*>(mapping), mapping_size);
+#endif
+  }
+#endif
+  mapping = nullptr;
+  mapping_size = 0;
+}
+
+#ifndef TEZ_NO_PREAD
+#if defined(WIN32)
+void TEZ::archive::source::open_raw_file(int fd) {
+  // owned by buf, we must not close it ourselves
+  HANDLE file = reinterpret_cast<HANDLE>(_get_osfhandle(fd));
+  if(file == INVALID_HANDLE_VALUE) return;
+  raw_file = reinterpret_cast<intptr_t>(file);
+}
+#else
+void TEZ::archive::source::open_raw_file(const std::string& path) {
+  if(path.empty()) return;
+  int fd = ::open(path.c_str(), O_RDONLY);
+  if(fd < 0) return;
+  raw_file = fd;
+}
+#endif
+#endif
+
+void TEZ::archive::source::close_raw_file() {
+  if(raw_file < 0) return;
+#if !defined(TEZ_NO_PREAD) && !defined(WIN32)
+  close(static_cast<int>(raw_file));
+#endif
+  raw_file = -1;
+}
+
+void TEZ::archive::source::advise(uint64_t offset, uint64_t length,
+                                  advice what) const {
+  if(offset >= size) return;
+  if(length == 0 || length > size - offset) length = size - offset;
+  // borrowed memory may well be on the heap, where dropping pages would
+  // zero them
+  if(borrowed && what == advice::dont_need) return;
+#if !defined(TEZ_NO_MMAP) && defined(WIN32)
+  if(mapping != nullptr) {
+    void* start = const_cast<uint8_t*>(mapping) + offset;
+    switch(what) {
+    case advice::will_need: {
+#if _WIN32_WINNT >= 0x0602
+      WIN32_MEMORY_RANGE_ENTRY range = {start, static_cast<SIZE_T>(length)};
+      PrefetchVirtualMemory(GetCurrentProcess(), 1, &range, 0);
+#endif
+      break;
+    }
+    case advice::dont_need:
+      // unlocking pages that aren't locked takes them out of our working set
+      VirtualUnlock(start, static_cast<SIZE_T>(length));
+      break;
+    default:
+      break;
+    }
+  }
+#elif !defined(TEZ_NO_MMAP)
+  if(mapping != nullptr) {
+    // madvise wants whole pages; we can hint at more than was asked for, but
+    // shouldn't drop pages that the files on either side still need
+    uint64_t page = static_cast<uint64_t>(sysconf(_SC_PAGESIZE));
+    uint64_t start = offset, end = offset + length;
+    if(what == advice::dont_need) {
+      start = (start + page - 1) / page * page;
+      if(end != size) end = end / page * page;
+      if(start >= end) return;
+    }
+    else start = start / page * page;
+    int how;
+    switch(what) {
+    case advice::will_need: how = MADV_WILLNEED; break;
+    case advice::dont_need: how = MADV_DONTNEED; break;
+    case advice::sequential: how = MADV_SEQUENTIAL; break;
+    default: case advice::random: how = MADV_RANDOM; break;
+    }
+    // only a hint, so failure doesn't matter
+    madvise(const_cast<uint8_t*>(mapping) + start,
+            static_cast<size_t>(end - start), how);
+    return;
+  }
+#endif
+#if !defined(TEZ_NO_PREAD) && defined(POSIX_FADV_WILLNEED)
+  if(raw_file >= 0) {
+    int how;
+    switch(what) {
+    case advice::will_need: how = POSIX_FADV_WILLNEED; break;
+    case advice::dont_need: how = POSIX_FADV_DONTNEED; break;
+    case advice::sequential: how = POSIX_FADV_SEQUENTIAL; break;
+    default: case advice::random: how = POSIX_FADV_RANDOM; break;
+    }
+    posix_fadvise(static_cast<int>(raw_file), static_cast<off_t>(offset),
+                  static_cast<off_t>(length), how);
+    return;
+  }
+#endif
+  // the stream backend has nothing to hint with
+  (void)what;
+}
+
+void TEZ::archive::advise_sequential() {
+  for(auto& src : sources) src->advise(0, 0, advice::sequential);
+}
+
+void TEZ::archive::advise_random() {
+  for(auto& src : sources) src->advise(0, 0, advice::random);
+}
+
+void TEZ::archive::advise_range(uint64_t offset, uint64_t length,
+                                bool need) const {
+  if(length == 0) return;
+  auto& src = *source_for(offset);
+  src.advise(offset - src.base, length,
+             need ? advice::will_need : advice::dont_need);
+}
+
+namespace {
+  // runs work(file) for every file, from a pool of threads (including this
+  // one) that take the files in order; rethrows the first exception any of
+  // them threw
+  void for_each_in_parallel(const std::vector<TEZ::archive::iterator>& files,
+                            unsigned threads,
+                            const std::function<void(TEZ::file&)>& work) {
+    if(threads == 0) threads = std::thread::hardware_concurrency();
+    if(threads == 0) threads = 1;
+    if(threads > files.size()) threads = files.size();
+    std::atomic<size_t> next(0);
+    std::mutex error_mutex;
+    std::exception_ptr error;
+    auto worker = [&]() {
+      size_t n;
+      while((n = next.fetch_add(1, std::memory_order_relaxed)) < files.size()) {
+        try { work(*files[n]); }
+        catch(...) {
+          std::unique_lock<std::mutex> lock(error_mutex);
+          if(!error) error = std::current_exception();
+          // make everyone else stop early
+          next.store(files.size(), std::memory_order_relaxed);
+        }
+      }
+    };
+    std::vector<std::thread> pool;
+    for(unsigned n = 1; n < threads; ++n) pool.emplace_back(worker);
+    worker();
+    for(auto& thread : pool) thread.join();
+    if(error) std::rethrow_exception(error);
+  }
+}
+
+// so that the threads read the executable (roughly) sequentially, even though
+// they decompress in parallel
+void TEZ::archive::sort_by_position(std::vector<iterator>& files) {
+  std::sort(files.begin(), files.end(), [](iterator a, iterator b) {
+      return a->get_offset() < b->get_offset();
+    });
+}
+
+void TEZ::archive::prefetch(const std::vector<iterator>& files,
+                            unsigned threads) {
+  std::vector<iterator> wanted;
+  for(auto f : files) {
+    if(f->method != METHOD_STORE && cache_wants(f->get_uncompressed_size()))
+      wanted.push_back(f);
+  }
+  sort_by_position(wanted);
+  for_each_in_parallel(wanted, threads, [this](file& f) {
+      f.read_cached(*this);
+    });
+}
+
+void TEZ::archive::prefetch(const std::vector<iterator>& files,
+                            unsigned threads,
+                            const std::function<void*(const file&)>& buffer_for) {
+  std::vector<iterator> sorted(files);
+  sort_by_position(sorted);
+  std::mutex buffer_mutex;
+  for_each_in_parallel(sorted, threads, [&](file& f) {
+      void* dst;
+      {
+        std::unique_lock<std::mutex> lock(buffer_mutex);
+        dst = buffer_for(f);
+      }
+      f.read_all(*this, dst, static_cast<size_t>(f.get_uncompressed_size()));
+    });
+}
+
+void TEZ::archive::async_submit(std::function<void()> job) {
+  std::unique_lock<std::mutex> lock(async_mutex);
+  if(async_threads.empty()) {
+    unsigned count = async_thread_count;
+    if(count == 0) count = std::thread::hardware_concurrency();
+    if(count == 0) count = 1;
+    for(unsigned n = 0; n < count; ++n) {
+      async_threads.emplace_back([this]() {
+          std::unique_lock<std::mutex> lock(async_mutex);
+          while(true) {
+            if(!async_queue.empty()) {
+              auto job = std::move(async_queue.front());
+              async_queue.pop_front();
+              lock.unlock();
+              job();
+              lock.lock();
+            }
+            else if(async_stopping) break;
+            else async_wake.wait(lock);
+          }
+        });
+    }
+  }
+  async_queue.emplace_back(std::move(job));
+  async_wake.notify_one();
+}
+
+// finishes every job in the queue, then stops the threads
+void TEZ::archive::async_stop() {
+  std::vector<std::thread> threads;
+  {
+    std::unique_lock<std::mutex> lock(async_mutex);
+    if(async_threads.empty()) return;
+    async_stopping = true;
+    threads = std::move(async_threads);
+    async_threads.clear();
+  }
+  async_wake.notify_all();
+  for(auto& thread : threads) thread.join();
+  std::unique_lock<std::mutex> lock(async_mutex);
+  async_stopping = false;
+}
+
+TEZ::archive::stats TEZ::archive::get_stats() const {
+#ifdef TEZ_ENABLE_STATS
+  auto get = [](const std::atomic<uint64_t>& counter) {
+    return counter.load(std::memory_order_relaxed);
+  };
+  return stats{get(counters.bytes_read), get(counters.read_calls),
+      get(counters.seeks), get(counters.lock_wait_ns),
+      get(counters.decompress_ns), get(counters.crc_ns),
+      get(counters.cache_hits), get(counters.cache_misses),
+      get(counters.restarts), get(counters.checkpoint_restores)};
+#else
+  return stats{};
+#endif
+}
+
+void TEZ::archive::reset_stats() {
+#ifdef TEZ_ENABLE_STATS
+  for(auto counter : {&counters.bytes_read, &counters.read_calls,
+        &counters.seeks, &counters.lock_wait_ns, &counters.decompress_ns,
+        &counters.crc_ns, &counters.cache_hits, &counters.cache_misses,
+        &counters.restarts, &counters.checkpoint_restores})
+    counter->store(0, std::memory_order_relaxed);
+#endif
+}
+
+void TEZ::archive::start_access_trace() {
+  std::unique_lock<std::mutex> lock(trace_mutex);
+  trace.clear();
+  traced.assign(file_count, false);
+  tracing.store(true, std::memory_order_relaxed);
+}
+
+std::vector<TEZ::archive::iterator> TEZ::archive::stop_access_trace() {
+  std::unique_lock<std::mutex> lock(trace_mutex);
+  tracing.store(false, std::memory_order_relaxed);
+  std::vector<iterator> ret;
+  ret.reserve(trace.size());
+  for(auto fileno : trace) ret.push_back(begin() + fileno);
+  trace.clear();
+  traced.clear();
+  return ret;
+}
+
+void TEZ::archive::record_access(uint32_t fileno) {
+  std::unique_lock<std::mutex> lock(trace_mutex);
+  // we might have stopped while we were waiting for the lock
+  if(!tracing.load(std::memory_order_relaxed)) return;
+  // files mounted since we started go on the end
+  if(fileno >= traced.size()) traced.resize(file_count, false);
+  if(traced[fileno]) return;
+  traced[fileno] = true;
+  trace.push_back(fileno);
+}
+
+void TEZ::archive::set_cache_budget(size_t bytes) {
+  std::unique_lock<std::mutex> lock(cache_mutex);
+  cache_budget.store(bytes, std::memory_order_relaxed);
+  cache_trim();
+}
+
+std::shared_ptr<const std::vector<uint8_t>>
+TEZ::archive::cache_find(uint32_t fileno) {
+  std::unique_lock<std::mutex> lock(cache_mutex);
+  auto it = cache.find(fileno);
+  if(it == cache.end()) {
+    TEZ_COUNT(cache_misses, 1);
+    return nullptr;
   }
-  for(auto it = file_map.begin(); it != file_map.end(); ++it) {
-    (*this)[it->second].filename = &it->first;
+  TEZ_COUNT(cache_hits, 1);
+  cache_lru.splice(cache_lru.begin(), cache_lru, it->second.lru);
+  return it->second.data;
+}
+
+std::shared_ptr<const std::vector<uint8_t>>
+TEZ::archive::cache_insert(uint32_t fileno, std::vector<uint8_t>&& data) {
+  auto ret = std::make_shared<const std::vector<uint8_t>>(std::move(data));
+  std::unique_lock<std::mutex> lock(cache_mutex);
+  if(!cache_wants(ret->size())) return ret;
+  auto it = cache.find(fileno);
+  if(it != cache.end()) {
+    // someone beat us to it, use theirs
+    cache_lru.splice(cache_lru.begin(), cache_lru, it->second.lru);
+    return it->second.data;
   }
-  for(auto it = begin(); it != end(); ++it) {
-    it->read_header(*this, it->offset);
+  cache_lru.push_front(fileno);
+  cache.emplace(fileno, cache_entry{ret, cache_lru.begin()});
+  cache_used += ret->size();
+  cache_trim();
+  return ret;
+}
+
+// cache_mutex must be held
+void TEZ::archive::cache_trim() {
+  auto it = cache_lru.end();
+  while(cache_used > cache_budget.load(std::memory_order_relaxed)
+        && it != cache_lru.begin()) {
+    --it;
+    auto entry = cache.find(*it);
+    // pinned, leave it alone
+    if(entry->second.data.use_count() > 1) continue;
+    cache_used -= entry->second.data->size();
+    cache.erase(entry);
+    it = cache_lru.erase(it);
   }
 }
 
+// the source that a (nonzero-length) read starting at offset comes from
+const TEZ::archive::source*
+TEZ::archive::source_for(uint64_t offset) const {
+  // almost always the executable, or one of a handful of mounts
+  auto it = std::upper_bound(sources.begin(), sources.end(), offset,
+                             [](uint64_t offset,
+                                const std::unique_ptr<source>& src) {
+                               return offset < src->base;
+                             });
+  if(it == sources.begin())
+    throw std::out_of_range("read past the end of the zipfile");
+  return (--it)->get();
+}
+
+const uint8_t* TEZ::archive::map_for_file(uint64_t offset,
+                                          uint64_t length) const {
+  if(sources.empty()) return nullptr;
+  auto& src = *source_for(offset);
+  if(src.mapping == nullptr) return nullptr;
+  offset -= src.base;
+  if(offset > src.mapping_size || length > src.mapping_size - offset)
+    throw std::out_of_range("read past the end of the zipfile");
+  return src.mapping + offset;
+}
+
 void TEZ::archive::read_for_file(void* _buffer,
-                                 uint32_t offset, uint32_t length) {
-  std::unique_lock<std::mutex> lock(mutex);
+                                 uint64_t offset, size_t length) {
+  if(length == 0) return;
+  TEZ_COUNT(read_calls, 1);
+  TEZ_COUNT(bytes_read, length);
+  // the mapping never changes while we're in use, and reads through it
+  // need no lock
+  auto mapped = map_for_file(offset, length);
+  if(mapped != nullptr) {
+    memcpy(_buffer, mapped, length);
+    return;
+  }
+  auto& src = const_cast<source&>(*source_for(offset));
+  offset -= src.base;
+  if(offset > src.size || length > src.size - offset)
+    throw std::out_of_range("read past the end of the zipfile");
+#ifndef TEZ_NO_PREAD
+  if(src.raw_file >= 0) {
+    // no lock needed, every read brings its own position
+    char* buffer = reinterpret_cast<char*>(_buffer);
+    while(length > 0) {
+      // keep each read comfortably within a DWORD (or ssize_t)
+      size_t amount = length > 0x40000000 ? 0x40000000 : length;
+#if defined(WIN32)
+      OVERLAPPED overlapped = {};
+      overlapped.Offset = static_cast<DWORD>(offset);
+      overlapped.OffsetHigh = static_cast<DWORD>(offset >> 32);
+      DWORD red;
+      if(!ReadFile(reinterpret_cast<HANDLE>(src.raw_file), buffer,
+                   static_cast<DWORD>(amount), &red, &overlapped)) {
+        if(GetLastError() == ERROR_HANDLE_EOF)
+          throw std::out_of_range("read past the end of the zipfile");
+        throw std::system_error(GetLastError(), std::system_category());
+      }
+#else
+      auto red = pread(static_cast<int>(src.raw_file), buffer, amount,
+                       static_cast<off_t>(offset));
+      if(red < 0) {
+        if(errno == EINTR) continue;
+        throw std::system_error(errno, std::generic_category());
+      }
+#endif
+      if(red == 0)
+        throw std::out_of_range("read past the end of the zipfile");
+      buffer += red;
+      offset += red;
+      length -= red;
+    }
+    return;
+  }
+#endif
+#ifdef TEZ_ENABLE_STATS
+  auto wait_start = std::chrono::steady_clock::now();
+#endif
+  std::unique_lock<std::mutex> lock(src.mutex);
+#ifdef TEZ_ENABLE_STATS
+  TEZ_COUNT(lock_wait_ns,
+            std::chrono::duration_cast<std::chrono::nanoseconds>
+            (std::chrono::steady_clock::now() - wait_start).count());
+#endif
   char* buffer = reinterpret_cast<char*>(_buffer);
-  if(streampos != offset)
-    stream.seekg(offset);
-  stream.read(buffer, length);
-  assert(stream.gcount() == length);
-  streampos = offset + length;
+  if(src.streampos != offset) {
+    TEZ_COUNT(seeks, 1);
+    src.stream.seekg(static_cast<std::streamoff>(offset));
+  }
+  src.stream.read(buffer, length);
+  assert(static_cast<size_t>(src.stream.gcount()) == length);
+  src.streampos = offset + length;
 }
 
 // technically not a member of archive, but this is really where it belongs
-void TEZ::file::read_header(archive& tez, uint32_t offset) {
-  tez.stream.seekg(offset);
+uint32_t TEZ::file::read_header(archive& tez) const {
   uint8_t buf[LOCAL_FILE_HEADER_LEN];
-  tez.stream.read(reinterpret_cast<char*>(buf), LOCAL_FILE_HEADER_LEN);
-  assert(tez.stream.gcount() == LOCAL_FILE_HEADER_LEN);
+  tez.read_for_file(buf, get_offset(), LOCAL_FILE_HEADER_LEN);
   if(get_uint32(buf) != 0x04034b50)
     throw std::runtime_error("file header is corrupted");
   // ignore most of the headers! we trust the central directory!
   uint16_t filename_length = get_uint16(buf+26);
   uint16_t extra_length = get_uint16(buf+28);
-  this->offset = offset + LOCAL_FILE_HEADER_LEN + filename_length + extra_length;
+  return LOCAL_FILE_HEADER_LEN + filename_length + extra_length;
+}
+
+void TEZ::file::will_need(archive& tez) const {
+  // reading the local header to find out exactly where the data starts would
+  // mean waiting for the very I/O we're trying to get started, so if we
+  // don't know yet, assume the longest extra field there can be
+  uint64_t skip = data_skip.load(std::memory_order_acquire) & ~VERIFIED;
+  if(skip == 0) skip = LOCAL_FILE_HEADER_LEN + filename_length + 0xFFFF;
+  tez.advise_range(get_offset(), skip + get_compressed_size(), true);
+}
+
+void TEZ::file::dont_need(archive& tez) const {
+  tez.advise_range(get_offset(),
+                   get_data_offset(tez) - get_offset() + get_compressed_size(),
+                   false);
 }
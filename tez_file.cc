@@ -3,26 +3,330 @@
 #include <assert.h>
 #include <zlib.h>
 
+#include <algorithm>
+
+// Streams from file::open always decompress with zlib (which can be zlib-ng
+// built in zlib-compatible mode). Whole-file reads (read_all and everything
+// built on it) know the decompressed size up front, so they can use a faster
+// one-shot decompressor instead: define TEZ_USE_LIBDEFLATE to use libdeflate.
+#ifdef TEZ_USE_LIBDEFLATE
+#include <libdeflate.h>
+#endif
+
+// Define TEZ_USE_ZSTD to also support members compressed with Zstandard
+// (method 93), which decompresses several times faster than Deflate. Files in
+// Zstandard's seekable format (independent frames, followed by a table of
+// their sizes) can be seeked in without decompressing from the start.
+#ifdef TEZ_USE_ZSTD
+#include <zstd.h>
+#endif
+
+// See TEZ_ENABLE_STATS in tez_archive.cc. TEZ_COUNT adds to one of an
+// archive's counters, and TEZ_TIME adds the time until the end of the
+// enclosing scope to one.
+#ifdef TEZ_ENABLE_STATS
+#include <chrono>
+struct TEZ::stats_access {
+  static archive::counter_set& of(archive& tez) { return tez.counters; }
+};
+#define TEZ_COUNT(tez, counter, amount) \
+  TEZ::stats_access::of(tez).counter.fetch_add((amount), \
+                                               std::memory_order_relaxed)
+#define TEZ_TIME(tez, counter) \
+  stat_timer tez_stat_timer(TEZ::stats_access::of(tez).counter)
+namespace {
+  class stat_timer {
+    std::atomic<uint64_t>& counter;
+    std::chrono::steady_clock::time_point start;
+  public:
+    explicit stat_timer(std::atomic<uint64_t>& counter)
+      : counter(counter), start(std::chrono::steady_clock::now()) {}
+    ~stat_timer() {
+      counter.fetch_add(std::chrono::duration_cast<std::chrono::nanoseconds>
+                        (std::chrono::steady_clock::now() - start).count(),
+                        std::memory_order_relaxed);
+    }
+  };
+}
+#else
+#define TEZ_COUNT(tez, counter, amount) ((void)0)
+#define TEZ_TIME(tez, counter) ((void)(tez))
+#endif
+
+// CRCs are computed with PCLMULQDQ on x86 and the CRC32 instructions on
+// ARMv8, when the CPU has them, and zlib otherwise. Define TEZ_NO_HW_CRC32 to
+// always use zlib.
+#if !defined(TEZ_NO_HW_CRC32) && defined(__GNUC__) \
+  && (defined(__x86_64__) || defined(__i386__))
+#define TEZ_CRC32_PCLMUL
+#include <immintrin.h>
+#elif !defined(TEZ_NO_HW_CRC32) && defined(__GNUC__) \
+  && defined(__aarch64__) && !defined(__ARM_BIG_ENDIAN)
+#if defined(__linux__) && !defined(__ARM_FEATURE_CRC32)
+#include <sys/auxv.h>
+#include <asm/hwcap.h>
+#endif
+// only where pick_crc32 can tell whether the CPU has the instructions
+#if defined(__ARM_FEATURE_CRC32) || defined(__APPLE__) \
+  || (defined(__linux__) && defined(HWCAP_CRC32))
+#define TEZ_CRC32_ARMV8
+#include <arm_acle.h>
+#endif
+#endif
+
+namespace {
+  typedef uint32_t (*crc32_function)(uint32_t crc, const uint8_t* buf,
+                                     size_t len);
+  uint32_t crc32_zlib(uint32_t crc, const uint8_t* buf, size_t len) {
+    // zlib only takes uInt lengths
+    while(len > 0) {
+      uInt amount = len > 0x40000000 ? 0x40000000 : static_cast<uInt>(len);
+      crc = crc32(crc, buf, amount);
+      buf += amount;
+      len -= amount;
+    }
+    return crc;
+  }
+#ifdef TEZ_CRC32_PCLMUL
+  // x1 * k (folded by 128 bits) + data
+  __attribute__((target("pclmul,sse4.1")))
+  inline __m128i crc32_fold_step(__m128i x1, __m128i k, __m128i data) {
+    __m128i lo = _mm_clmulepi64_si128(x1, k, 0x00);
+    __m128i hi = _mm_clmulepi64_si128(x1, k, 0x11);
+    return _mm_xor_si128(_mm_xor_si128(hi, lo), data);
+  }
+  __attribute__((target("pclmul,sse4.1")))
+  inline __m128i crc32_load(const uint8_t* p) {
+    return _mm_loadu_si128(reinterpret_cast<const __m128i*>(p));
+  }
+  // Folds 64 bytes at a time with carry-less multiplies, then reduces to 32
+  // bits; see Intel's "Fast CRC Computation for Generic Polynomials Using
+  // PCLMULQDQ Instruction". The constants are the ones Chromium's zlib uses.
+  // Takes and returns the CRC without the usual inversion. len must be at
+  // least 64, and a multiple of 16.
+  __attribute__((target("pclmul,sse4.1")))
+  uint32_t crc32_fold(uint32_t crc, const uint8_t* buf, size_t len) {
+    alignas(16) static const uint64_t k1k2[] = {0x0154442bd4, 0x01c6e41596};
+    alignas(16) static const uint64_t k3k4[] = {0x01751997d0, 0x00ccaa009e};
+    alignas(16) static const uint64_t k5k0[] = {0x0163cd6124, 0x0000000000};
+    alignas(16) static const uint64_t poly[] = {0x01db710641, 0x01f7011641};
+    __m128i x0, x1, x2, x3, x4;
+    x1 = _mm_xor_si128(crc32_load(buf), _mm_cvtsi32_si128(crc));
+    x2 = crc32_load(buf + 16);
+    x3 = crc32_load(buf + 32);
+    x4 = crc32_load(buf + 48);
+    buf += 64;
+    len -= 64;
+    x0 = _mm_load_si128(reinterpret_cast<const __m128i*>(k1k2));
+    while(len >= 64) {
+      x1 = crc32_fold_step(x1, x0, crc32_load(buf));
+      x2 = crc32_fold_step(x2, x0, crc32_load(buf + 16));
+      x3 = crc32_fold_step(x3, x0, crc32_load(buf + 32));
+      x4 = crc32_fold_step(x4, x0, crc32_load(buf + 48));
+      buf += 64;
+      len -= 64;
+    }
+    // fold the four lanes into one
+    x0 = _mm_load_si128(reinterpret_cast<const __m128i*>(k3k4));
+    x1 = crc32_fold_step(x1, x0, x2);
+    x1 = crc32_fold_step(x1, x0, x3);
+    x1 = crc32_fold_step(x1, x0, x4);
+    while(len >= 16) {
+      x1 = crc32_fold_step(x1, x0, crc32_load(buf));
+      buf += 16;
+      len -= 16;
+    }
+    // 128 bits to 64 bits
+    x2 = _mm_clmulepi64_si128(x1, x0, 0x10);
+    x3 = _mm_setr_epi32(~0, 0, ~0, 0);
+    x1 = _mm_xor_si128(_mm_srli_si128(x1, 8), x2);
+    x0 = _mm_loadl_epi64(reinterpret_cast<const __m128i*>(k5k0));
+    x2 = _mm_srli_si128(x1, 4);
+    x1 = _mm_clmulepi64_si128(_mm_and_si128(x1, x3), x0, 0x00);
+    x1 = _mm_xor_si128(x1, x2);
+    // Barrett reduction to 32 bits
+    x0 = _mm_load_si128(reinterpret_cast<const __m128i*>(poly));
+    x2 = _mm_clmulepi64_si128(_mm_and_si128(x1, x3), x0, 0x10);
+    x2 = _mm_clmulepi64_si128(_mm_and_si128(x2, x3), x0, 0x00);
+    x1 = _mm_xor_si128(x1, x2);
+    return static_cast<uint32_t>(_mm_extract_epi32(x1, 1));
+  }
+  uint32_t crc32_pclmul(uint32_t crc, const uint8_t* buf, size_t len) {
+    if(len >= 64) {
+      size_t amount = len & ~size_t(15);
+      crc = ~crc32_fold(~crc, buf, amount);
+      buf += amount;
+      len -= amount;
+    }
+    return crc32(crc, buf, static_cast<uInt>(len));
+  }
+#endif
+#ifdef TEZ_CRC32_ARMV8
+#ifdef __clang__
+  __attribute__((target("crc")))
+#else
+  __attribute__((target("+crc")))
+#endif
+  uint32_t crc32_armv8(uint32_t crc, const uint8_t* buf, size_t len) {
+    crc = ~crc;
+    while(len > 0 && (reinterpret_cast<uintptr_t>(buf) & 7) != 0) {
+      crc = __crc32b(crc, *buf++);
+      --len;
+    }
+    while(len >= 8) {
+      uint64_t word;
+      memcpy(&word, buf, 8);
+      crc = __crc32d(crc, word);
+      buf += 8;
+      len -= 8;
+    }
+    while(len > 0) {
+      crc = __crc32b(crc, *buf++);
+      --len;
+    }
+    return ~crc;
+  }
+#endif
+  crc32_function pick_crc32() {
+#if defined(TEZ_CRC32_PCLMUL)
+    __builtin_cpu_init();
+    if(__builtin_cpu_supports("pclmul") && __builtin_cpu_supports("sse4.1"))
+      return crc32_pclmul;
+#elif defined(TEZ_CRC32_ARMV8)
+#if defined(__ARM_FEATURE_CRC32) || defined(__APPLE__)
+    return crc32_armv8;
+#else
+    if(getauxval(AT_HWCAP) & HWCAP_CRC32) return crc32_armv8;
+#endif
+#endif
+    return crc32_zlib;
+  }
+  uint32_t crc32_update(uint32_t crc, const uint8_t* buf, size_t len) {
+    static const crc32_function impl = pick_crc32();
+    return impl(crc, buf, len);
+  }
+}
+
+uint32_t TEZ::crc32_update(uint32_t crc, const void* buf, size_t len) {
+  return ::crc32_update(crc, reinterpret_cast<const uint8_t*>(buf), len);
+}
+
 namespace {
+  class CRC32 {
+    uint32_t crc = 0;
+  public:
+    CRC32() {}
+    explicit CRC32(uint32_t crc) : crc(crc) {}
+    void update(const uint8_t* buf, size_t len) {
+      crc = crc32_update(crc, buf, len);
+    }
+    bool check(uint32_t crc) {
+      return crc == this->crc;
+    }
+    uint32_t get() const { return crc; }
+  };
   class stored_data_streambuf : public std::streambuf {
     TEZ::archive& tez;
-    uint32_t start_pos, cur_pos, end_pos;
-    char buffer[4096];
+    // if the executable is mapped, the file itself; otherwise, nullptr
+    const uint8_t* mapped;
+    // if mapped and not verifying, the get area is the whole file, and cur_pos
+    // is always end_pos
+    uint64_t start_pos, cur_pos, end_pos;
+    // when verifying, how much of the file (from the beginning) the CRC covers
+    // so far; a stream that seeks past data it never read can't be verified
+    bool verifying;
+    uint64_t crc_pos;
+    uint32_t desired_crc;
+    CRC32 crc;
+    // set once the CRC has been checked, if non-null
+    std::atomic<uint32_t>* verified;
+    // small_buffer, unless a bigger one was asked for
+    char* buffer;
+    size_t buffer_size;
+    std::unique_ptr<char[]> big_buffer;
+    char small_buffer[4096];
+    // reads the next amount bytes of the file into dst, or points dst at them
+    // if we're mapped
+    void fetch(char*& dst, size_t amount) {
+      if(mapped != nullptr)
+        dst = const_cast<char*>(reinterpret_cast<const char*>(mapped))
+          + (cur_pos - start_pos);
+      else
+        tez.read_for_file(dst, cur_pos, amount);
+      if(verifying && cur_pos - start_pos == crc_pos) {
+        {
+          TEZ_TIME(tez, crc_ns);
+          crc.update(reinterpret_cast<uint8_t*>(dst), amount);
+        }
+        crc_pos += amount;
+        if(crc_pos == end_pos - start_pos) {
+          if(!crc.check(desired_crc))
+            throw std::runtime_error("checksum mismatch");
+          if(verified)
+            verified->fetch_or(TEZ::file::VERIFIED, std::memory_order_relaxed);
+        }
+      }
+      cur_pos += amount;
+    }
   public:
     stored_data_streambuf(TEZ::archive& tez,
-                          uint32_t start_pos, uint32_t end_pos)
-      : tez(tez), start_pos(start_pos), cur_pos(start_pos), end_pos(end_pos) {}
+                          uint64_t start_pos, uint64_t end_pos,
+                          bool verifying, uint32_t desired_crc,
+                          std::atomic<uint32_t>* verified, size_t buffer_size)
+      : tez(tez), start_pos(start_pos), cur_pos(start_pos), end_pos(end_pos),
+        verifying(verifying), crc_pos(0), desired_crc(desired_crc),
+        verified(verified), buffer(small_buffer),
+        buffer_size(sizeof(small_buffer)) {
+      mapped = tez.map_for_file(start_pos, end_pos - start_pos);
+      if(mapped != nullptr && !verifying) {
+        // std::streambuf wants non-const pointers, but never writes through
+        // them in an input-only buffer
+        auto p = const_cast<char*>(reinterpret_cast<const char*>(mapped));
+        setg(p, p, p + (end_pos - start_pos));
+        cur_pos = end_pos;
+      }
+      else if(mapped == nullptr && buffer_size > sizeof(small_buffer)) {
+        big_buffer = std::make_unique<char[]>(buffer_size);
+        buffer = big_buffer.get();
+        this->buffer_size = buffer_size;
+      }
+    }
     virtual std::streamsize showmanyc() override {
       return end_pos - cur_pos;
     }
     virtual int underflow() override {
       if(cur_pos == end_pos) return std::char_traits<char>::eof();
-      uint32_t amount = end_pos - cur_pos;
-      if(amount > sizeof(buffer)) amount = sizeof(buffer);
-      tez.read_for_file(buffer, cur_pos, amount);
-      cur_pos += amount;
-      setg(buffer, buffer, buffer + amount);
-      return static_cast<unsigned char>(buffer[0]);
+      // when mapped, still serve straight from the mapping, but in pieces
+      // small enough to still be in cache when it's the reader's turn
+      size_t amount = mapped != nullptr ? 65536 : buffer_size;
+      if(amount > end_pos - cur_pos) amount = end_pos - cur_pos;
+      char* p = buffer;
+      fetch(p, amount);
+      setg(p, p, p + amount);
+      return static_cast<unsigned char>(p[0]);
+    }
+    // big reads skip the buffer, and go straight to their destination
+    virtual std::streamsize xsgetn(char* dst, std::streamsize n) override {
+      std::streamsize ret = 0;
+      std::streamsize buffered = egptr() - gptr();
+      if(buffered > n) buffered = n;
+      if(buffered > 0) {
+        memcpy(dst, gptr(), buffered);
+        setg(eback(), gptr() + buffered, egptr());
+        ret += buffered;
+      }
+      if(n - ret >= static_cast<std::streamsize>(buffer_size)
+         && cur_pos != end_pos) {
+        size_t amount = n - ret;
+        if(amount > end_pos - cur_pos) amount = end_pos - cur_pos;
+        char* p = dst + ret;
+        fetch(p, amount);
+        if(p != dst + ret) memcpy(dst + ret, p, amount);
+        ret += amount;
+        setg(nullptr, nullptr, nullptr);
+      }
+      if(ret < n) ret += std::streambuf::xsgetn(dst + ret, n - ret);
+      return ret;
     }
     virtual pos_type seekoff(off_type off, std::ios_base::seekdir dir,
                              std::ios_base::openmode which) override {
@@ -32,7 +336,7 @@ namespace {
       case std::istream::beg:
         break;
       case std::istream::cur:
-        off += (cur_pos - start_pos);
+        off += (cur_pos - start_pos) - (egptr() - gptr());
         break;
       case std::istream::end:
         off += (end_pos - start_pos);
@@ -40,79 +344,650 @@ namespace {
       }
       return seekpos(off, which);
     }
-    virtual pos_type seekpos(pos_type off,
+    virtual pos_type seekpos(pos_type _off,
                              std::ios_base::openmode which) override {
       (void)which;
       assert(which == std::istream::in);
-      if(off < 0) off = 0;
-      else if(off > end_pos - start_pos) off = end_pos - start_pos;
-      cur_pos = start_pos + off;
+      uint64_t off;
+      if(_off < 0) off = 0;
+      else if(static_cast<uint64_t>(_off) > end_pos - start_pos)
+        off = end_pos - start_pos;
+      else off = static_cast<uint64_t>(_off);
+      // still in the get area? (when mapped and not verifying, always)
+      uint64_t buffer_start = (cur_pos - start_pos) - (egptr() - eback());
+      if(off >= buffer_start && off <= cur_pos - start_pos) {
+        setg(eback(), eback() + (off - buffer_start), egptr());
+      }
+      else {
+        cur_pos = start_pos + off;
+        setg(nullptr, nullptr, nullptr);
+      }
       return off;
     }
   };
-  class CRC32 {
-    uint32_t crc = crc32(0, nullptr, 0);
-  public:
-    void update(const uint8_t* buf, size_t len) {
-      crc = crc32(crc, buf, len);
+  constexpr uint32_t DEFAULT_SEEK_INDEX_SPACING = 1 << 20;
+  // how many unused inflaters an archive keeps around
+  constexpr size_t MAX_IDLE_INFLATERS = 16;
+  // compressed files no bigger than this (compressed or not) are decompressed
+  // all at once by file::open, instead of a bit at a time as they're read
+  constexpr size_t SMALL_FILE_SIZE = 4096;
+  // for files that are going to be in memory all at once
+  size_t in_memory_size(uint64_t size) {
+    if(size > SIZE_MAX)
+      throw std::length_error("file is too big to fit in memory");
+    return static_cast<size_t>(size);
+  }
+}
+
+struct TEZ::inflater : z_stream {
+  char in_buffer[4096], out_buffer[4096];
+  // zlib's own allocations (the inflate state and the window, about 40KiB on
+  // 64-bit platforms) come out of here, unless they don't fit; nothing is
+  // freed until the inflater itself is, since inflateReset keeps them all
+  size_t arena_used = 0;
+  alignas(16) unsigned char arena[48 * 1024];
+  static voidpf arena_alloc(voidpf opaque, uInt items, uInt size) {
+    auto self = reinterpret_cast<inflater*>(opaque);
+    size_t amount = (size_t(items) * size + 15) & ~size_t(15);
+    if(amount <= sizeof(arena) - self->arena_used) {
+      auto ret = self->arena + self->arena_used;
+      self->arena_used += amount;
+      return ret;
     }
-    bool check(uint32_t crc) {
-      return crc == this->crc;
+    return malloc(size_t(items) * size);
+  }
+  static void arena_free(voidpf opaque, voidpf address) {
+    auto self = reinterpret_cast<inflater*>(opaque);
+    auto p = reinterpret_cast<unsigned char*>(address);
+    if(p < self->arena || p >= self->arena + sizeof(arena)) free(address);
+  }
+  inflater() : z_stream() {
+    zalloc = arena_alloc;
+    zfree = arena_free;
+    opaque = this;
+    if(inflateInit2(this, -15) != Z_OK)
+      throw std::runtime_error("could not initialize zlib");
+  }
+  ~inflater() { inflateEnd(this); }
+  // zlib's state points back at the z_stream, so this can never move
+  inflater(const inflater&) = delete;
+  inflater& operator=(const inflater&) = delete;
+};
+
+void TEZ::inflater_deleter::operator()(inflater* p) const {
+  delete p;
+}
+
+TEZ::inflater_ptr TEZ::archive::take_inflater() {
+  {
+    std::unique_lock<std::mutex> lock(inflater_mutex);
+    if(!idle_inflaters.empty()) {
+      auto ret = std::move(idle_inflaters.back());
+      idle_inflaters.pop_back();
+      return ret;
     }
+  }
+  return inflater_ptr(new inflater());
+}
+
+void TEZ::archive::give_back_inflater(inflater_ptr p) {
+  // it may have been left in the middle of a stream, or an error; and
+  // whatever it was pointed at may be gone, so the next user starts clean
+  if(inflateReset(p.get()) != Z_OK) return;
+  p->next_in = nullptr;
+  p->avail_in = 0;
+  p->next_out = nullptr;
+  p->avail_out = 0;
+  std::unique_lock<std::mutex> lock(inflater_mutex);
+  if(idle_inflaters.size() < MAX_IDLE_INFLATERS)
+    idle_inflaters.push_back(std::move(p));
+}
+
+namespace {
+  // decompresses a whole raw deflate stream, which must decompress to exactly
+  // out_len bytes
+  void inflate_whole(TEZ::archive& tez, const uint8_t* in, size_t in_len,
+                     uint8_t* out, size_t out_len) {
+    TEZ_TIME(tez, decompress_ns);
+#ifdef TEZ_USE_LIBDEFLATE
+    (void)tez;
+    // allocating one of these is much more expensive than decompressing a
+    // small file, so keep one around for each thread
+    struct decompressor_holder {
+      libdeflate_decompressor* p = libdeflate_alloc_decompressor();
+      ~decompressor_holder() { if(p) libdeflate_free_decompressor(p); }
+    };
+    thread_local decompressor_holder decompressor;
+    if(decompressor.p == nullptr) throw std::bad_alloc();
+    // no actual_out_nbytes_ret, so anything but exactly out_len bytes fails
+    if(libdeflate_deflate_decompress(decompressor.p, in, in_len, out, out_len,
+                                     nullptr) != LIBDEFLATE_SUCCESS)
+      throw std::runtime_error("libdeflate error");
+#else
+    auto z = tez.take_inflater();
+    z->next_in = const_cast<uint8_t*>(in);
+    // zlib won't take a null next_out, even for no output at all (as with an
+    // empty vector's data())
+    uint8_t nothing;
+    z->next_out = out != nullptr ? out : &nothing;
+    // zlib counts in uInts, so feed it no more than 1GiB at a time
+    z->avail_in = z->avail_out = 0;
+    int ret;
+    do {
+      if(z->avail_in == 0) {
+        size_t amount = in_len > 0x40000000 ? 0x40000000 : in_len;
+        z->avail_in = static_cast<uInt>(amount);
+        in_len -= amount;
+      }
+      if(z->avail_out == 0) {
+        size_t amount = out_len > 0x40000000 ? 0x40000000 : out_len;
+        z->avail_out = static_cast<uInt>(amount);
+        out_len -= amount;
+      }
+      ret = inflate(z.get(), Z_NO_FLUSH);
+    } while(ret == Z_OK);
+    bool ok = ret == Z_STREAM_END && z->avail_out == 0 && out_len == 0;
+    tez.give_back_inflater(std::move(z));
+    if(!ok) throw std::runtime_error("zlib error");
+#endif
+  }
+}
+
+// Everything we need to resume inflating in the middle of a file, at block
+// boundaries spaced (roughly) evenly through it. This is the same approach as
+// zlib's examples/zran.c.
+struct TEZ::seek_index {
+  struct checkpoint {
+    // position in the decompressed data
+    uint64_t out_pos;
+    // position in the compressed data (relative to the start of the file) of
+    // the first byte inflate hadn't touched yet
+    uint64_t in_pos;
+    // CRC of everything before out_pos
+    uint32_t crc;
+    // how many bits of the byte before in_pos are still unused, and that byte
+    uint8_t bits, prime_byte;
+    uint16_t window_len;
+    // the last (up to) 32KiB of decompressed data before out_pos
+    std::unique_ptr<uint8_t[]> window;
   };
-  class deflated_streambuf : public std::streambuf, private z_stream {
+  std::vector<checkpoint> checkpoints;
+  // how far the data has been decompressed, and the next place we'd like a
+  // checkpoint (while still building)
+  uint64_t covered = 0, next_checkpoint = 0;
+  uint32_t spacing;
+  explicit seek_index(uint32_t spacing) : next_checkpoint(spacing),
+                                          spacing(spacing) {}
+  // the last checkpoint at or before pos, or nullptr if there isn't one
+  const checkpoint* find(uint64_t pos) const {
+    auto it = std::upper_bound(checkpoints.begin(), checkpoints.end(), pos,
+                               [](uint64_t pos, const checkpoint& cp) {
+                                 return pos < cp.out_pos;
+                               });
+    if(it == checkpoints.begin()) return nullptr;
+    return &*--it;
+  }
+};
+
+// technically not members of file, but they're only used here
+std::shared_ptr<const TEZ::seek_index>
+TEZ::archive::get_seek_index(uint32_t fileno) {
+  if(seek_index_count.load(std::memory_order_acquire) == 0) return nullptr;
+  std::unique_lock<std::mutex> lock(seek_index_mutex);
+  auto it = seek_indices.find(fileno);
+  if(it == seek_indices.end()) return nullptr;
+  return it->second;
+}
+
+void TEZ::archive::offer_seek_index(uint32_t fileno,
+                                    std::shared_ptr<const seek_index> index) {
+  std::unique_lock<std::mutex> lock(seek_index_mutex);
+  auto& slot = seek_indices[fileno];
+  if(!slot) seek_index_count.fetch_add(1, std::memory_order_release);
+  // keep whichever one knows about more of the file
+  if(!slot || slot->covered < index->covered) slot = std::move(index);
+}
+
+namespace {
+  class deflated_streambuf : public std::streambuf {
     TEZ::archive& tez;
-    uint32_t in_start_pos, in_cur_pos, in_end_pos;
-    uint32_t out_cur_pos, out_end_pos, desired_crc;
+    uint32_t fileno;
+    uint64_t in_start_pos, in_cur_pos, in_end_pos;
+    uint64_t out_cur_pos, out_end_pos;
+    uint32_t desired_crc;
+    // the CRC is also kept up to date while building an index, even if we
+    // aren't checking it, since checkpoints need it
+    bool verifying;
     CRC32 crc;
-    char in_buffer[4096], out_buffer[4096];
+    // set once the CRC has been checked, if non-null
+    std::atomic<uint32_t>* verified;
+    // the best index we know about for this file, and the one we're building
+    // as we go (if any)
+    std::shared_ptr<const TEZ::seek_index> index;
+    std::unique_ptr<TEZ::seek_index> new_index;
+    // the z_stream, and the inflater's buffers (unless bigger ones were asked
+    // for)
+    TEZ::inflater_ptr z;
+    char* in_buffer;
+    char* out_buffer;
+    size_t buffer_size;
+    std::unique_ptr<char[]> big_buffers;
+    // where the output inflate is currently working on starts
+    char* chunk;
+    void publish_index() {
+      if(new_index && !new_index->checkpoints.empty())
+        tez.offer_seek_index(fileno, std::move(new_index));
+      new_index.reset();
+    }
+    void add_checkpoint() {
+      uint64_t out_pos = out_cur_pos
+        + (reinterpret_cast<char*>(z->next_out) - chunk);
+      if(out_pos < new_index->next_checkpoint || out_pos >= out_end_pos)
+        return;
+      uint64_t in_pos = in_cur_pos - z->avail_in - in_start_pos;
+      uint8_t bits = z->data_type & 7;
+      if(bits != 0 && reinterpret_cast<char*>(z->next_in) == in_buffer)
+        return; // we don't have the partial byte anymore, try again later
+      TEZ::seek_index::checkpoint cp;
+      cp.out_pos = out_pos;
+      cp.in_pos = in_pos;
+      CRC32 partial = crc;
+      partial.update(reinterpret_cast<uint8_t*>(chunk),
+                     reinterpret_cast<char*>(z->next_out) - chunk);
+      cp.crc = partial.get();
+      cp.bits = bits;
+      cp.prime_byte = bits ? z->next_in[-1] : 0;
+      cp.window = std::make_unique<uint8_t[]>(32768);
+      uInt window_len = 32768;
+      if(inflateGetDictionary(z.get(), cp.window.get(), &window_len) != Z_OK)
+        return;
+      cp.window_len = window_len;
+      new_index->checkpoints.emplace_back(std::move(cp));
+      new_index->next_checkpoint = out_pos + new_index->spacing;
+    }
+    // decompresses up to cap bytes (and at least one, unless we're at the end
+    // of the file) into dst, returning how many
+    size_t inflate_into(char* dst, size_t cap) {
+      if(cap > out_end_pos - out_cur_pos) cap = out_end_pos - out_cur_pos;
+      if(cap > 0x40000000) cap = 0x40000000;
+      if(cap == 0) return 0;
+      chunk = dst;
+      z->next_out = reinterpret_cast<uint8_t*>(dst);
+      z->avail_out = static_cast<uInt>(cap);
+      do {
+        if(z->avail_in == 0) {
+          size_t amount = buffer_size;
+          if(amount > in_end_pos - in_cur_pos) amount = in_end_pos - in_cur_pos;
+          tez.read_for_file(in_buffer, in_cur_pos, amount);
+          in_cur_pos += amount;
+          z->next_in = reinterpret_cast<uint8_t*>(in_buffer);
+          z->avail_in = static_cast<uInt>(amount);
+        }
+        // while building an index, stop at every block boundary, so we can
+        // consider making a checkpoint there
+        int ret;
+        {
+          TEZ_TIME(tez, decompress_ns);
+          ret = inflate(z.get(), new_index ? Z_BLOCK : Z_NO_FLUSH);
+        }
+        if(ret == Z_STREAM_END && z->avail_out != 0)
+          throw std::runtime_error("file is shorter than it should be");
+        if(ret != Z_OK && ret != Z_STREAM_END)
+          throw std::runtime_error("zlib error");
+        if(new_index && (z->data_type & 128) && !(z->data_type & 64))
+          add_checkpoint();
+      } while(z->avail_out != 0);
+      if(verifying || new_index) {
+        TEZ_TIME(tez, crc_ns);
+        crc.update(reinterpret_cast<uint8_t*>(dst), cap);
+      }
+      out_cur_pos += cap;
+      if(new_index && out_cur_pos > new_index->covered)
+        new_index->covered = out_cur_pos;
+      if(out_cur_pos == out_end_pos) {
+        publish_index();
+        if(verifying) {
+          if(!crc.check(desired_crc))
+            throw std::runtime_error("checksum mismatch");
+          if(verified)
+            verified->fetch_or(TEZ::file::VERIFIED, std::memory_order_relaxed);
+        }
+      }
+      return cap;
+    }
+    void restart() {
+      inflateReset(z.get());
+      crc = CRC32();
+      in_cur_pos = in_start_pos;
+      out_cur_pos = 0;
+      z->avail_in = 0;
+    }
+    void restore(const TEZ::seek_index::checkpoint& cp) {
+      inflateReset(z.get());
+      if(cp.bits != 0)
+        inflatePrime(z.get(), cp.bits, cp.prime_byte >> (8 - cp.bits));
+      inflateSetDictionary(z.get(), cp.window.get(), cp.window_len);
+      crc = CRC32(cp.crc);
+      in_cur_pos = in_start_pos + cp.in_pos;
+      out_cur_pos = cp.out_pos;
+      z->avail_in = 0;
+    }
   public:
-    deflated_streambuf(TEZ::archive& tez,
-                       uint32_t start_pos, uint32_t end_pos,
-                       uint32_t uncompressed_size, uint32_t desired_crc)
-      : tez(tez),
+    deflated_streambuf(TEZ::archive& tez, uint32_t fileno,
+                       uint64_t start_pos, uint64_t end_pos,
+                       uint64_t uncompressed_size, uint32_t desired_crc,
+                       bool verifying, std::atomic<uint32_t>* verified,
+                       uint32_t index_spacing, size_t buffer_size = 0)
+      : tez(tez), fileno(fileno),
         in_start_pos(start_pos), in_cur_pos(start_pos), in_end_pos(end_pos),
         out_cur_pos(0), out_end_pos(uncompressed_size),
-        desired_crc(desired_crc) {
-      zalloc = nullptr;
-      zfree = nullptr;
-      opaque = nullptr;
-      if(inflateInit2(this, -15) != Z_OK) {
-        throw std::runtime_error("could not initialize zlib");
+        desired_crc(desired_crc), verifying(verifying), verified(verified),
+        z(tez.take_inflater()), in_buffer(z->in_buffer),
+        out_buffer(z->out_buffer), buffer_size(sizeof(z->in_buffer)),
+        chunk(nullptr) {
+      // zlib counts in uInts
+      if(buffer_size > 0x40000000) buffer_size = 0x40000000;
+      if(buffer_size > this->buffer_size) {
+        big_buffers = std::make_unique<char[]>(buffer_size * 2);
+        in_buffer = big_buffers.get();
+        out_buffer = in_buffer + buffer_size;
+        this->buffer_size = buffer_size;
       }
-      avail_in = 0;
-      avail_out = 0;
+      z->avail_in = 0;
+      z->avail_out = 0;
+      index = tez.get_seek_index(fileno);
+      if(index_spacing != 0 && uncompressed_size > index_spacing
+         && (!index || index->covered < out_end_pos))
+        new_index = std::make_unique<TEZ::seek_index>(index_spacing);
     }
     ~deflated_streambuf() {
-      inflateEnd(this);
+      publish_index();
+      tez.give_back_inflater(std::move(z));
     }
     virtual std::streamsize showmanyc() override {
       return out_end_pos - out_cur_pos;
     }
     virtual int underflow() override {
-      if(out_cur_pos == out_end_pos) return std::char_traits<char>::eof();
-      do {
-        if(avail_in == 0) {
-          uint32_t amount = in_end_pos - in_cur_pos;
-          if(amount > sizeof(in_buffer)) amount = sizeof(in_buffer);
+      auto amount = inflate_into(out_buffer, buffer_size);
+      if(amount == 0) return std::char_traits<char>::eof();
+      setg(out_buffer, out_buffer, out_buffer + amount);
+      return static_cast<unsigned char>(out_buffer[0]);
+    }
+    // big reads skip the buffer, and decompress straight into their
+    // destination
+    virtual std::streamsize xsgetn(char* dst, std::streamsize n) override {
+      std::streamsize ret = 0;
+      std::streamsize buffered = egptr() - gptr();
+      if(buffered > n) buffered = n;
+      if(buffered > 0) {
+        memcpy(dst, gptr(), buffered);
+        setg(eback(), gptr() + buffered, egptr());
+        ret += buffered;
+      }
+      while(n - ret >= static_cast<std::streamsize>(buffer_size)) {
+        auto amount = inflate_into(dst + ret, n - ret);
+        if(amount == 0) break;
+        ret += amount;
+        setg(nullptr, nullptr, nullptr);
+      }
+      if(ret < n) ret += std::streambuf::xsgetn(dst + ret, n - ret);
+      return ret;
+    }
+    virtual pos_type seekoff(off_type off, std::ios_base::seekdir dir,
+                             std::ios_base::openmode which) override {
+      assert(which == std::istream::in);
+      switch(dir) {
+      default:
+      case std::istream::beg:
+        break;
+      case std::istream::cur:
+        off += out_cur_pos - (egptr() - gptr());
+        break;
+      case std::istream::end:
+        off += out_end_pos;
+        break;
+      }
+      return seekpos(off, which);
+    }
+    virtual pos_type seekpos(pos_type _off,
+                             std::ios_base::openmode which) override {
+      (void)which;
+      assert(which == std::istream::in);
+      uint64_t off;
+      if(_off < 0) off = 0;
+      else if(static_cast<uint64_t>(_off) > out_end_pos) off = out_end_pos;
+      else off = static_cast<uint64_t>(_off);
+      // still in the buffer?
+      uint64_t buffer_start = out_cur_pos - (egptr() - eback());
+      if(off >= buffer_start && off <= out_cur_pos) {
+        setg(eback(), eback() + (off - buffer_start), egptr());
+        return off;
+      }
+      // can we skip ahead (or back) using a checkpoint?
+      const TEZ::seek_index::checkpoint* cp = nullptr;
+      if(new_index) cp = new_index->find(off);
+      if(index) {
+        auto other = index->find(off);
+        if(other != nullptr && (cp == nullptr || other->out_pos > cp->out_pos))
+          cp = other;
+      }
+      if(cp != nullptr && (off < out_cur_pos || cp->out_pos > out_cur_pos)) {
+        TEZ_COUNT(tez, checkpoint_restores, 1);
+        restore(*cp);
+      }
+      else if(off < out_cur_pos) {
+        TEZ_COUNT(tez, restarts, 1);
+        restart();
+      }
+      // now decompress our way forward
+      setg(nullptr, nullptr, nullptr);
+      while(out_cur_pos < off) {
+        if(underflow() == std::char_traits<char>::eof()) break;
+      }
+      if(eback() != nullptr) {
+        // the last read region ends at out_cur_pos, let's see how far we
+        // overshot by
+        setg(eback(), egptr() - (out_cur_pos - off), egptr());
+      }
+      return off;
+    }
+    // decompress everything, building a full index if we're building one
+    void build_index() {
+      seekpos(out_end_pos, std::istream::in);
+    }
+  };
+#ifdef TEZ_USE_ZSTD
+  inline uint32_t get_uint32(const uint8_t* p) {
+    return p[0] |
+      (uint32_t(p[1])<<8) |
+      (uint32_t(p[2])<<16) |
+      (uint32_t(p[3])<<24);
+  }
+  // Reads the seek table at the end of a file in Zstandard's seekable format,
+  // returning an index with a (windowless) checkpoint at the start of each
+  // frame. If the file isn't in that format, the index has no checkpoints.
+  std::shared_ptr<const TEZ::seek_index>
+  read_zstd_seek_table(TEZ::archive& tez, uint64_t start_pos,
+                       uint64_t end_pos, uint64_t uncompressed_size) {
+    constexpr uint32_t SKIPPABLE_MAGIC = 0x184D2A5E;
+    constexpr uint32_t SEEKABLE_MAGIC = 0x8F92EAB1;
+    constexpr int SKIPPABLE_HEADER_LEN = 8, SEEK_TABLE_FOOTER_LEN = 9;
+    auto ret = std::make_shared<TEZ::seek_index>(0);
+    ret->covered = uncompressed_size;
+    uint64_t length = end_pos - start_pos;
+    if(length < SKIPPABLE_HEADER_LEN + SEEK_TABLE_FOOTER_LEN) return ret;
+    uint8_t footer[SEEK_TABLE_FOOTER_LEN];
+    tez.read_for_file(footer, end_pos - sizeof(footer), sizeof(footer));
+    uint32_t frame_count = get_uint32(footer);
+    uint8_t descriptor = footer[4];
+    // bits 2-6 are reserved; bit 7 means each entry has a checksum, which we
+    // don't need, since we have the CRC
+    if(get_uint32(footer+5) != SEEKABLE_MAGIC || (descriptor & 0x7C) != 0)
+      return ret;
+    size_t entry_len = (descriptor & 0x80) ? 12 : 8;
+    uint64_t table_len = uint64_t(frame_count) * entry_len
+      + SEEK_TABLE_FOOTER_LEN;
+    if(table_len > length - SKIPPABLE_HEADER_LEN) return ret;
+    std::vector<uint8_t> table(in_memory_size(table_len
+                                              + SKIPPABLE_HEADER_LEN));
+    tez.read_for_file(table.data(), end_pos - table.size(), table.size());
+    if(get_uint32(table.data()) != SKIPPABLE_MAGIC
+       || get_uint32(table.data()+4) != table_len)
+      return ret;
+    std::vector<TEZ::seek_index::checkpoint> checkpoints(frame_count);
+    uint64_t in_pos = 0, out_pos = 0;
+    const uint8_t* p = table.data() + SKIPPABLE_HEADER_LEN;
+    for(auto& cp : checkpoints) {
+      cp.out_pos = out_pos;
+      cp.in_pos = in_pos;
+      cp.crc = 0;
+      cp.bits = 0;
+      cp.prime_byte = 0;
+      cp.window_len = 0;
+      in_pos += get_uint32(p);
+      out_pos += get_uint32(p+4);
+      p += entry_len;
+    }
+    // a table that doesn't add up is as good as no table
+    if(in_pos != length - table.size() || out_pos != uncompressed_size)
+      return ret;
+    ret->checkpoints = std::move(checkpoints);
+    return ret;
+  }
+  struct dstream_deleter {
+    void operator()(ZSTD_DStream* p) const { ZSTD_freeDStream(p); }
+  };
+  struct dctx_deleter {
+    void operator()(ZSTD_DCtx* p) const { ZSTD_freeDCtx(p); }
+  };
+  class zstd_streambuf : public std::streambuf {
+    TEZ::archive& tez;
+    uint64_t in_start_pos, in_cur_pos, in_end_pos;
+    uint64_t out_cur_pos, out_end_pos;
+    // when verifying, how much of the file (from the beginning) the CRC covers
+    // so far; a stream that skips frames can't be verified unless it comes
+    // back for them
+    bool verifying;
+    uint64_t crc_pos;
+    uint32_t desired_crc;
+    CRC32 crc;
+    // set once the CRC has been checked, if non-null
+    std::atomic<uint32_t>* verified;
+    // frame boundaries, if the file is in the seekable format
+    std::shared_ptr<const TEZ::seek_index> index;
+    std::unique_ptr<ZSTD_DStream, dstream_deleter> z;
+    ZSTD_inBuffer in;
+    char* in_buffer;
+    size_t in_buffer_size;
+    char* out_buffer;
+    size_t out_buffer_size;
+    std::unique_ptr<char[]> buffers;
+    // decompresses up to cap bytes (and at least one, unless we're at the end
+    // of the file) into dst, returning how many
+    size_t decompress_into(char* dst, size_t cap) {
+      if(cap > out_end_pos - out_cur_pos) cap = out_end_pos - out_cur_pos;
+      if(cap == 0) return 0;
+      ZSTD_outBuffer out = {dst, cap, 0};
+      while(out.pos < out.size) {
+        if(in.pos == in.size) {
+          size_t amount = in_buffer_size;
+          if(amount > in_end_pos - in_cur_pos) amount = in_end_pos - in_cur_pos;
+          if(amount == 0)
+            throw std::runtime_error("file is shorter than it should be");
           tez.read_for_file(in_buffer, in_cur_pos, amount);
           in_cur_pos += amount;
-          next_in = reinterpret_cast<uint8_t*>(in_buffer);
-          avail_in = amount;
+          in = {in_buffer, amount, 0};
         }
-        next_out = reinterpret_cast<uint8_t*>(out_buffer);
-        avail_out = sizeof(out_buffer);
-        auto ret = inflate(this, 0);
-        if(ret != Z_OK && ret != Z_STREAM_END)
-          throw std::runtime_error("zlib error");
-      } while(reinterpret_cast<char*>(next_out) == out_buffer);
-      setg(out_buffer, out_buffer, reinterpret_cast<char*>(next_out));
-      crc.update(reinterpret_cast<uint8_t*>(eback()), egptr()-eback());
-      out_cur_pos += egptr() - eback();
-      if(out_cur_pos == out_end_pos && !crc.check(desired_crc))
-        throw std::runtime_error("checksum mismatch");
+        size_t ret;
+        {
+          TEZ_TIME(tez, decompress_ns);
+          ret = ZSTD_decompressStream(z.get(), &out, &in);
+        }
+        if(ZSTD_isError(ret))
+          throw std::runtime_error(ZSTD_getErrorName(ret));
+      }
+      uint64_t chunk_end = out_cur_pos + cap;
+      if(verifying && out_cur_pos <= crc_pos && chunk_end > crc_pos) {
+        // only the part we haven't already covered
+        {
+          TEZ_TIME(tez, crc_ns);
+          crc.update(reinterpret_cast<uint8_t*>(dst) + (crc_pos - out_cur_pos),
+                     chunk_end - crc_pos);
+        }
+        crc_pos = chunk_end;
+        if(crc_pos == out_end_pos) {
+          if(!crc.check(desired_crc))
+            throw std::runtime_error("checksum mismatch");
+          if(verified)
+            verified->fetch_or(TEZ::file::VERIFIED, std::memory_order_relaxed);
+        }
+      }
+      out_cur_pos = chunk_end;
+      return cap;
+    }
+    // starts decompressing from the frame at in_pos, which decompresses to
+    // data starting at out_pos
+    void jump(uint64_t in_pos, uint64_t out_pos) {
+      ZSTD_DCtx_reset(z.get(), ZSTD_reset_session_only);
+      in_cur_pos = in_start_pos + in_pos;
+      out_cur_pos = out_pos;
+      in = {in_buffer, 0, 0};
+    }
+  public:
+    zstd_streambuf(TEZ::archive& tez, uint32_t fileno,
+                   uint64_t start_pos, uint64_t end_pos,
+                   uint64_t uncompressed_size, uint32_t desired_crc,
+                   bool verifying, std::atomic<uint32_t>* verified,
+                   size_t buffer_size = 0)
+      : tez(tez),
+        in_start_pos(start_pos), in_cur_pos(start_pos), in_end_pos(end_pos),
+        out_cur_pos(0), out_end_pos(uncompressed_size),
+        verifying(verifying), crc_pos(0), desired_crc(desired_crc),
+        verified(verified), z(ZSTD_createDStream()), in({nullptr, 0, 0}) {
+      if(!z) throw std::bad_alloc();
+      // zstd's recommended sizes, which are about one block each
+      in_buffer_size = ZSTD_DStreamInSize();
+      out_buffer_size = std::max(buffer_size, ZSTD_DStreamOutSize());
+      buffers = std::make_unique<char[]>(in_buffer_size + out_buffer_size);
+      in_buffer = buffers.get();
+      out_buffer = in_buffer + in_buffer_size;
+      in.src = in_buffer;
+      index = tez.get_seek_index(fileno);
+      if(!index) {
+        index = read_zstd_seek_table(tez, start_pos, end_pos,
+                                     uncompressed_size);
+        tez.offer_seek_index(fileno, index);
+      }
+    }
+    virtual std::streamsize showmanyc() override {
+      return out_end_pos - out_cur_pos;
+    }
+    virtual int underflow() override {
+      auto amount = decompress_into(out_buffer, out_buffer_size);
+      if(amount == 0) return std::char_traits<char>::eof();
+      setg(out_buffer, out_buffer, out_buffer + amount);
       return static_cast<unsigned char>(out_buffer[0]);
     }
+    // big reads skip the buffer, and decompress straight into their
+    // destination
+    virtual std::streamsize xsgetn(char* dst, std::streamsize n) override {
+      std::streamsize ret = 0;
+      std::streamsize buffered = egptr() - gptr();
+      if(buffered > n) buffered = n;
+      if(buffered > 0) {
+        memcpy(dst, gptr(), buffered);
+        setg(eback(), gptr() + buffered, egptr());
+        ret += buffered;
+      }
+      while(n - ret >= static_cast<std::streamsize>(out_buffer_size)) {
+        auto amount = decompress_into(dst + ret, n - ret);
+        if(amount == 0) break;
+        ret += amount;
+        setg(nullptr, nullptr, nullptr);
+      }
+      if(ret < n) ret += std::streambuf::xsgetn(dst + ret, n - ret);
+      return ret;
+    }
     virtual pos_type seekoff(off_type off, std::ios_base::seekdir dir,
                              std::ios_base::openmode which) override {
       assert(which == std::istream::in);
@@ -121,7 +996,7 @@ namespace {
       case std::istream::beg:
         break;
       case std::istream::cur:
-        off += out_cur_pos;
+        off += out_cur_pos - (egptr() - gptr());
         break;
       case std::istream::end:
         off += out_end_pos;
@@ -129,36 +1004,255 @@ namespace {
       }
       return seekpos(off, which);
     }
-    virtual pos_type seekpos(pos_type off,
+    virtual pos_type seekpos(pos_type _off,
                              std::ios_base::openmode which) override {
       (void)which;
       assert(which == std::istream::in);
-      if(off < 0) off = 0;
-      else if(off > out_end_pos) off = out_end_pos;
-      if(off < out_cur_pos) {
-        // start from the beginning
-        inflateReset(this);
-        crc = CRC32();
-        in_cur_pos = in_start_pos;
-        out_cur_pos = 0;
-      }
-      if(off == out_cur_pos) {
-        // don't need to do anything!
-        setg(nullptr, nullptr, nullptr);
+      uint64_t off;
+      if(_off < 0) off = 0;
+      else if(static_cast<uint64_t>(_off) > out_end_pos) off = out_end_pos;
+      else off = static_cast<uint64_t>(_off);
+      // still in the buffer?
+      uint64_t buffer_start = out_cur_pos - (egptr() - eback());
+      if(off >= buffer_start && off <= out_cur_pos) {
+        setg(eback(), eback() + (off - buffer_start), egptr());
+        return off;
       }
-      else {
-        while(underflow() != std::char_traits<char>::eof()
-              && out_cur_pos >= off)
-          {}
-        if(out_cur_pos == out_end_pos) return std::char_traits<char>::eof();
-        // the last read region is now *behind* out_cur_pos, let's see how far
-        // we overshot by
-        auto overshoot_amount = out_cur_pos - off;
-        setg(eback(), egptr() - overshoot_amount, egptr());
+      // can we skip ahead (or back) to the start of a frame?
+      auto cp = index->find(off);
+      if(cp != nullptr && (off < out_cur_pos || cp->out_pos > out_cur_pos)) {
+        TEZ_COUNT(tez, checkpoint_restores, 1);
+        jump(cp->in_pos, cp->out_pos);
+      }
+      else if(off < out_cur_pos) {
+        TEZ_COUNT(tez, restarts, 1);
+        jump(0, 0);
       }
-      return out_cur_pos;
+      // now decompress our way forward
+      setg(nullptr, nullptr, nullptr);
+      while(out_cur_pos < off) {
+        if(underflow() == std::char_traits<char>::eof()) break;
+      }
+      if(eback() != nullptr) {
+        // the last read region ends at out_cur_pos, let's see how far we
+        // overshot by
+        setg(eback(), egptr() - (out_cur_pos - off), egptr());
+      }
+      return off;
     }
   };
+  // decompresses a whole file, which must decompress to exactly out_len bytes
+  void zstd_decompress_whole(TEZ::archive& tez,
+                             const uint8_t* in, size_t in_len,
+                             uint8_t* out, size_t out_len) {
+    TEZ_TIME(tez, decompress_ns);
+    auto ret = ZSTD_decompress(out, out_len, in, in_len);
+    if(ZSTD_isError(ret)) throw std::runtime_error(ZSTD_getErrorName(ret));
+    if(ret != out_len)
+      throw std::runtime_error("file is shorter than it should be");
+  }
+#endif
+  // inflates a piece of a raw deflate stream, out_len bytes long, into out,
+  // starting from cp (or the beginning, if cp is null); in is the whole
+  // stream, and the last piece has to end where the stream does
+  void inflate_segment(TEZ::archive& tez, z_stream* z,
+                       const uint8_t* in, size_t in_len,
+                       const TEZ::seek_index::checkpoint* cp,
+                       uint8_t* out, size_t out_len, bool last) {
+    TEZ_TIME(tez, decompress_ns);
+    inflateReset(z);
+    if(cp != nullptr) {
+      if(cp->bits != 0)
+        inflatePrime(z, cp->bits, cp->prime_byte >> (8 - cp->bits));
+      inflateSetDictionary(z, cp->window.get(), cp->window_len);
+      in += cp->in_pos;
+      in_len -= static_cast<size_t>(cp->in_pos);
+    }
+    z->next_in = const_cast<uint8_t*>(in);
+    z->avail_in = 0;
+    z->next_out = out;
+    z->avail_out = 0;
+    // see inflate_whole
+    int ret;
+    do {
+      if(z->avail_in == 0) {
+        size_t amount = in_len > 0x40000000 ? 0x40000000 : in_len;
+        z->avail_in = static_cast<uInt>(amount);
+        in_len -= amount;
+      }
+      if(z->avail_out == 0) {
+        size_t amount = out_len > 0x40000000 ? 0x40000000 : out_len;
+        z->avail_out = static_cast<uInt>(amount);
+        out_len -= amount;
+      }
+      ret = inflate(z, Z_NO_FLUSH);
+    } while(ret == Z_OK && (last || z->avail_out != 0 || out_len != 0));
+    bool full = z->avail_out == 0 && out_len == 0;
+    if(last ? ret != Z_STREAM_END || !full
+       : (ret != Z_OK && ret != Z_STREAM_END) || !full)
+      throw std::runtime_error("zlib error");
+  }
+  // crc32_combine for a second part of any length; zlib takes the length as
+  // a z_off_t, which is only 32 bits on Windows and many 32-bit builds (and
+  // so is z_off64_t, unless large file support is on), so shift the first
+  // CRC past the second part 1GiB at a time: combining with a CRC of 0 does
+  // just the shift
+  uLong crc32_combine_long(uLong crc1, uLong crc2, uint64_t len2) {
+    while(len2 > 0x40000000) {
+      crc1 = crc32_combine(crc1, 0, static_cast<z_off_t>(0x40000000));
+      len2 -= 0x40000000;
+    }
+    return crc32_combine(crc1, crc2, static_cast<z_off_t>(len2));
+  }
+  // decompresses a whole file, which must decompress to exactly out_len
+  // bytes, on several threads at once: each one starts from a different
+  // checkpoint of index (deflate) or frame of the seek table (Zstandard), so
+  // the index must cover the whole file; if crc isn't null, it's set to the
+  // CRC of the decompressed data
+  void decompress_in_parallel(TEZ::archive& tez, uint16_t method,
+                              const TEZ::seek_index& index, unsigned threads,
+                              const uint8_t* in, size_t in_len,
+                              uint8_t* out, size_t out_len, uint32_t* crc) {
+    // the pieces that can be decompressed independently, by where they start
+    // in the output; a piece that starts at 0 has no checkpoint
+    std::vector<const TEZ::seek_index::checkpoint*> starts;
+    if(index.checkpoints.empty() || index.checkpoints[0].out_pos != 0)
+      starts.push_back(nullptr);
+    for(auto& cp : index.checkpoints) starts.push_back(&cp);
+    auto out_start = [&](size_t n) -> size_t {
+      if(n == starts.size()) return out_len;
+      return starts[n] ? static_cast<size_t>(starts[n]->out_pos) : 0;
+    };
+    auto in_start = [&](size_t n) -> size_t {
+      if(n == starts.size()) return in_len;
+      return starts[n] ? static_cast<size_t>(starts[n]->in_pos) : 0;
+    };
+    std::vector<uint32_t> crcs(starts.size());
+    std::atomic<size_t> next(0);
+    std::mutex error_mutex;
+    std::exception_ptr error;
+    auto work = [&]() {
+      try {
+#ifdef TEZ_USE_ZSTD
+        if(method == 93) {
+          std::unique_ptr<ZSTD_DCtx, dctx_deleter> dctx(ZSTD_createDCtx());
+          if(!dctx) throw std::bad_alloc();
+          size_t n;
+          while((n = next.fetch_add(1)) < starts.size()) {
+            size_t out_len = out_start(n+1) - out_start(n);
+            size_t ret;
+            {
+              TEZ_TIME(tez, decompress_ns);
+              // the last piece ends with the seek table, which is a
+              // skippable frame
+              ret = ZSTD_decompressDCtx(dctx.get(), out + out_start(n),
+                                        out_len, in + in_start(n),
+                                        in_start(n+1) - in_start(n));
+            }
+            if(ZSTD_isError(ret))
+              throw std::runtime_error(ZSTD_getErrorName(ret));
+            if(ret != out_len)
+              throw std::runtime_error("file is shorter than it should be");
+            if(crc) {
+              TEZ_TIME(tez, crc_ns);
+              crcs[n] = TEZ::crc32_update(0, out + out_start(n), out_len);
+            }
+          }
+          return;
+        }
+#endif
+        (void)method;
+        (void)in_start;
+        auto z = tez.take_inflater();
+        size_t n;
+        while((n = next.fetch_add(1)) < starts.size()) {
+          size_t out_len = out_start(n+1) - out_start(n);
+          inflate_segment(tez, z.get(), in, in_len, starts[n],
+                          out + out_start(n), out_len, n + 1 == starts.size());
+          if(crc) {
+            TEZ_TIME(tez, crc_ns);
+            crcs[n] = TEZ::crc32_update(0, out + out_start(n), out_len);
+          }
+        }
+        tez.give_back_inflater(std::move(z));
+      }
+      catch(...) {
+        std::unique_lock<std::mutex> lock(error_mutex);
+        if(!error) error = std::current_exception();
+        // nobody else needs to bother
+        next.store(starts.size());
+      }
+    };
+    if(threads > starts.size()) threads = static_cast<unsigned>(starts.size());
+    std::vector<std::thread> pool;
+    for(unsigned n = 1; n < threads; ++n) pool.emplace_back(work);
+    work();
+    for(auto& thread : pool) thread.join();
+    if(error) std::rethrow_exception(error);
+    if(crc) {
+      uLong ret = crcs[0];
+      for(size_t n = 1; n < starts.size(); ++n)
+        ret = crc32_combine_long(ret, crcs[n],
+                                 out_start(n+1) - out_start(n));
+      *crc = static_cast<uint32_t>(ret);
+    }
+  }
+  // serves whatever the get area is set to, which is the whole file
+  class array_streambuf : public std::streambuf {
+  public:
+    virtual std::streamsize showmanyc() override {
+      return egptr() - gptr();
+    }
+    virtual pos_type seekoff(off_type off, std::ios_base::seekdir dir,
+                             std::ios_base::openmode which) override {
+      assert(which == std::istream::in);
+      switch(dir) {
+      default:
+      case std::istream::beg:
+        break;
+      case std::istream::cur:
+        off += gptr() - eback();
+        break;
+      case std::istream::end:
+        off += egptr() - eback();
+        break;
+      }
+      return seekpos(off, which);
+    }
+    virtual pos_type seekpos(pos_type off,
+                             std::ios_base::openmode which) override {
+      (void)which;
+      assert(which == std::istream::in);
+      if(off < 0) off = 0;
+      else if(off > egptr() - eback()) off = egptr() - eback();
+      setg(eback(), eback() + off, egptr());
+      return off;
+    }
+  };
+  // serves a file that's already been decompressed into memory
+  class memory_streambuf : public array_streambuf {
+    std::shared_ptr<const std::vector<uint8_t>> data;
+  public:
+    memory_streambuf(std::shared_ptr<const std::vector<uint8_t>> data)
+      : data(std::move(data)) {
+      // std::streambuf wants non-const pointers, but never writes through
+      // them in an input-only buffer
+      auto p = const_cast<char*>(reinterpret_cast<const char*>
+                                 (this->data->data()));
+      setg(p, p, p + this->data->size());
+    }
+  };
+  // serves a small file, which file::open decompresses into it in one go;
+  // that's much cheaper than setting up to decompress it a bit at a time
+  class small_file_streambuf : public array_streambuf {
+    char data[SMALL_FILE_SIZE];
+  public:
+    explicit small_file_streambuf(size_t size) {
+      assert(size <= sizeof(data));
+      setg(data, data, data + size);
+    }
+    char* get_data() { return data; }
+  };
   template<class T> class istream_embedded_buf : public std::istream {
     T buf;
   public:
@@ -168,17 +1262,257 @@ namespace {
 }
 
 std::unique_ptr<std::istream> TEZ::file::open(TEZ::archive& tez) const {
+  return open(tez, tez.verify, 0);
+}
+
+std::unique_ptr<std::istream> TEZ::file::open(TEZ::archive& tez,
+                                              size_t buffer_size) const {
+  return open(tez, tez.verify, buffer_size);
+}
+
+std::unique_ptr<std::istream> TEZ::file::open(TEZ::archive& tez,
+                                              verify_policy policy,
+                                              size_t buffer_size) const {
+  tez.note_access(static_cast<uint32_t>(this - tez.begin()));
+  auto uncompressed_size = get_uncompressed_size();
+  auto compressed_size = get_compressed_size();
+  // the cache's copy was only checked according to the archive's policy
+  if(method != 0 && !stricter(policy, tez.verify)
+     && tez.cache_wants(uncompressed_size)) {
+    return std::make_unique<istream_embedded_buf<memory_streambuf>>
+      (read_cached(tez));
+  }
+  if(method != 0 && uncompressed_size <= SMALL_FILE_SIZE
+     && compressed_size <= SMALL_FILE_SIZE) {
+    std::unique_ptr<std::istream> ret
+      = std::make_unique<istream_embedded_buf<small_file_streambuf>>
+      (static_cast<size_t>(uncompressed_size));
+    read_all_uncached(tez, static_cast<small_file_streambuf*>(ret->rdbuf())
+                      ->get_data(), policy);
+    return ret;
+  }
+  auto offset = get_data_offset(tez);
   switch(method) {
   default:
   case 0:
     assert(compressed_size == uncompressed_size);
     return std::make_unique<istream_embedded_buf<stored_data_streambuf>>
-      (tez, offset, offset+uncompressed_size);
+      (tez, offset, offset+uncompressed_size,
+       tez.verify_stored.load(std::memory_order_relaxed)
+       && wants_verify(policy), crc32, verified_flag(policy), buffer_size);
     break;
   case 8:
     return std::make_unique<istream_embedded_buf<deflated_streambuf>>
-      (tez, offset, offset+compressed_size, uncompressed_size, crc32);
+      (tez, static_cast<uint32_t>(this - tez.begin()),
+       offset, offset+compressed_size, uncompressed_size, crc32,
+       wants_verify(policy), verified_flag(policy),
+       tez.seek_index_spacing.load(std::memory_order_relaxed), buffer_size);
     break;
+#ifdef TEZ_USE_ZSTD
+  case 93:
+    return std::make_unique<istream_embedded_buf<zstd_streambuf>>
+      (tez, static_cast<uint32_t>(this - tez.begin()),
+       offset, offset+compressed_size, uncompressed_size, crc32,
+       wants_verify(policy), verified_flag(policy), buffer_size);
+    break;
+#endif
   }
   /* NOTREACHED */
 }
+
+void TEZ::file::verify(TEZ::archive& tez, const void* data,
+                       verify_policy policy) const {
+  if(!wants_verify(policy)) return;
+  TEZ_TIME(tez, crc_ns);
+  CRC32 crc;
+  crc.update(reinterpret_cast<const uint8_t*>(data),
+             in_memory_size(get_uncompressed_size()));
+  if(!crc.check(crc32))
+    throw std::runtime_error("checksum mismatch");
+  mark_verified();
+}
+
+void TEZ::file::read_all_uncached(TEZ::archive& tez, void* dst,
+                                  verify_policy policy) const {
+  auto uncompressed_size = in_memory_size(get_uncompressed_size());
+  auto compressed_size = in_memory_size(get_compressed_size());
+  auto offset = get_data_offset(tez);
+  switch(method) {
+  default:
+  case 0:
+    assert(compressed_size == uncompressed_size);
+    tez.read_for_file(dst, offset, uncompressed_size);
+    if(tez.verify_stored.load(std::memory_order_relaxed))
+      verify(tez, dst, policy);
+    break;
+  case 8:
+#ifdef TEZ_USE_ZSTD
+  case 93:
+#endif
+  {
+    std::unique_ptr<uint8_t[]> in_buffer;
+    uint8_t small_in_buffer[SMALL_FILE_SIZE];
+    auto in = tez.map_for_file(offset, compressed_size);
+    if(in == nullptr) {
+      uint8_t* buffer = small_in_buffer;
+      if(compressed_size > sizeof(small_in_buffer)) {
+        in_buffer = std::make_unique<uint8_t[]>(compressed_size);
+        buffer = in_buffer.get();
+      }
+      tez.read_for_file(buffer, offset, compressed_size);
+      in = buffer;
+    }
+    if(read_in_parallel(tez, in, dst, policy)) break;
+#ifdef TEZ_USE_ZSTD
+    if(method == 93)
+      zstd_decompress_whole(tez, in, compressed_size,
+                            reinterpret_cast<uint8_t*>(dst),
+                            uncompressed_size);
+    else
+#endif
+    inflate_whole(tez, in, compressed_size,
+                  reinterpret_cast<uint8_t*>(dst), uncompressed_size);
+    verify(tez, dst, policy);
+    break;
+  }
+  }
+}
+
+bool TEZ::file::read_in_parallel(TEZ::archive& tez, const uint8_t* in,
+                                 void* dst, verify_policy policy) const {
+  auto threshold = tez.parallel_threshold.load(std::memory_order_relaxed);
+  auto uncompressed_size = get_uncompressed_size();
+  if(threshold == 0 || uncompressed_size < threshold) return false;
+  auto index = tez.get_seek_index(static_cast<uint32_t>(this - tez.begin()));
+#ifdef TEZ_USE_ZSTD
+  // the seek table hasn't been read yet if no stream has opened the file
+  if(!index && method == 93) {
+    auto offset = get_data_offset(tez);
+    index = read_zstd_seek_table(tez, offset, offset + get_compressed_size(),
+                                 uncompressed_size);
+    tez.offer_seek_index(static_cast<uint32_t>(this - tez.begin()), index);
+  }
+#endif
+  // with only a checkpoint or two, there's not much to do in parallel
+  if(!index || index->covered != uncompressed_size
+     || index->checkpoints.size() < 2)
+    return false;
+  unsigned threads = tez.parallel_threads.load(std::memory_order_relaxed);
+  if(threads == 0) threads = std::thread::hardware_concurrency();
+  if(threads < 2) return false;
+  bool verifying = wants_verify(policy);
+  uint32_t crc;
+  decompress_in_parallel(tez, method, *index, threads, in,
+                         in_memory_size(get_compressed_size()),
+                         reinterpret_cast<uint8_t*>(dst),
+                         in_memory_size(uncompressed_size),
+                         verifying ? &crc : nullptr);
+  if(verifying) {
+    if(crc != crc32) throw std::runtime_error("checksum mismatch");
+    mark_verified();
+  }
+  return true;
+}
+
+size_t TEZ::file::read_all(TEZ::archive& tez, void* dst, size_t cap) const {
+  tez.note_access(static_cast<uint32_t>(this - tez.begin()));
+  auto uncompressed_size = get_uncompressed_size();
+  if(cap < uncompressed_size)
+    throw std::length_error("buffer too small for file");
+  if(method != 0 && tez.cache_wants(uncompressed_size)) {
+    auto cached = read_cached(tez);
+    // an empty vector's data() may be null, which memcpy mustn't get
+    if(!cached->empty()) memcpy(dst, cached->data(), cached->size());
+  }
+  else read_all_uncached(tez, dst, tez.verify);
+  return static_cast<size_t>(uncompressed_size);
+}
+
+std::vector<uint8_t> TEZ::file::read_all(TEZ::archive& tez) const {
+  tez.note_access(static_cast<uint32_t>(this - tez.begin()));
+  auto uncompressed_size = in_memory_size(get_uncompressed_size());
+  if(method != 0 && tez.cache_wants(uncompressed_size))
+    return *read_cached(tez);
+  std::vector<uint8_t> ret(uncompressed_size);
+  read_all_uncached(tez, ret.data(), tez.verify);
+  return ret;
+}
+
+std::shared_ptr<const std::vector<uint8_t>>
+TEZ::file::read_cached(TEZ::archive& tez) const {
+  uint32_t fileno = static_cast<uint32_t>(this - tez.begin());
+  tez.note_access(fileno);
+  std::vector<uint8_t> data;
+  if(!tez.cache_wants(get_uncompressed_size())) {
+    // it couldn't be in there, and won't be going in
+    data.resize(in_memory_size(get_uncompressed_size()));
+    read_all_uncached(tez, data.data(), tez.verify);
+    return std::make_shared<const std::vector<uint8_t>>(std::move(data));
+  }
+  auto ret = tez.cache_find(fileno);
+  if(ret) return ret;
+  data.resize(in_memory_size(get_uncompressed_size()));
+  read_all_uncached(tez, data.data(), tez.verify);
+  return tez.cache_insert(fileno, std::move(data));
+}
+
+void TEZ::file::read_async(TEZ::archive& tez,
+                           std::function<void(std::vector<uint8_t>&&,
+                                              std::exception_ptr)> callback)
+  const {
+  tez.async_submit([this, &tez, callback]() {
+      std::vector<uint8_t> data;
+      std::exception_ptr error;
+      try { data = read_all(tez); }
+      catch(...) { error = std::current_exception(); }
+      // there's nobody on a worker thread to hand the callback's own
+      // exceptions to, and letting one escape would terminate the program
+      try { callback(std::move(data), error); }
+      catch(...) {}
+    });
+}
+
+std::future<std::vector<uint8_t>>
+TEZ::file::read_async(TEZ::archive& tez) const {
+  auto promise = std::make_shared<std::promise<std::vector<uint8_t>>>();
+  auto ret = promise->get_future();
+  read_async(tez, [promise](std::vector<uint8_t>&& data,
+                            std::exception_ptr error) {
+      if(error) promise->set_exception(error);
+      else promise->set_value(std::move(data));
+    });
+  return ret;
+}
+
+void TEZ::file::build_seek_index(TEZ::archive& tez) const {
+  if(method != 8) return;
+  auto uncompressed_size = get_uncompressed_size();
+  auto compressed_size = get_compressed_size();
+  uint32_t fileno = static_cast<uint32_t>(this - tez.begin());
+  auto existing = tez.get_seek_index(fileno);
+  if(existing && existing->covered == uncompressed_size) return;
+  auto spacing = tez.seek_index_spacing.load(std::memory_order_relaxed);
+  if(spacing == 0) spacing = DEFAULT_SEEK_INDEX_SPACING;
+  auto offset = get_data_offset(tez);
+  deflated_streambuf buf(tez, fileno, offset, offset+compressed_size,
+                         uncompressed_size, crc32, wants_verify(tez.verify),
+                         verified_flag(tez.verify), spacing);
+  buf.build_index();
+}
+
+TEZ::data_span TEZ::file::data_view(TEZ::archive& tez) const {
+  tez.note_access(static_cast<uint32_t>(this - tez.begin()));
+  auto uncompressed_size = get_uncompressed_size();
+  if(method != 0) {
+    if(!tez.cache_wants(uncompressed_size)) return data_span();
+    auto cached = read_cached(tez);
+    return data_span(cached->data(), cached->size(), cached);
+  }
+  auto offset = get_data_offset(tez);
+  auto mapped = tez.map_for_file(offset, uncompressed_size);
+  if(mapped == nullptr) return data_span();
+  if(tez.verify_stored.load(std::memory_order_relaxed))
+    verify(tez, mapped, tez.verify);
+  // the mapping fits in memory, so the file does too
+  return data_span(mapped, static_cast<size_t>(uncompressed_size));
+}
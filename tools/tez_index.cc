@@ -0,0 +1,287 @@
+// Embeds an index in a zipfile (or in an executable with one appended, after
+// zip --adjust-sfx), so that TEZ::archive::init and mount can load its files
+// without parsing the central directory. The index is a stored member, placed
+// right before the central directory. Run this again after changing the
+// zipfile; until then, TEZ notices the index no longer matches, and parses the
+// central directory as usual.
+//
+// Build it with the same TEZ_* defines as your program, so that it accepts the
+// same zipfiles:
+//
+//   g++ -std=c++14 -O2 -I.. tez_index.cc ../tez_archive.cc ../tez_file.cc
+//     -o tez_index -lz
+//   tez_index my_program
+
+#include "tez.hh"
+
+#include <iostream>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+#if defined(WIN32)
+#include <io.h>
+#include <fcntl.h>
+#else
+#include <unistd.h>
+#endif
+
+namespace {
+  constexpr int END_OF_CENTRAL_DIRECTORY_LEN = 22;
+  constexpr int CENTRAL_DIRECTORY_RECORD_LEN = 46;
+  constexpr int LOCAL_FILE_HEADER_LEN = 30;
+  constexpr int ZIP64_LOCATOR_LEN = 20;
+  constexpr int ZIP64_END_OF_CENTRAL_DIRECTORY_LEN = 56;
+  inline uint16_t get_uint16(const uint8_t* p) {
+    return p[0] | (uint16_t(p[1])<<8);
+  }
+  inline uint32_t get_uint32(const uint8_t* p) {
+    return get_uint16(p) | (uint32_t(get_uint16(p+2))<<16);
+  }
+  inline uint64_t get_uint64(const uint8_t* p) {
+    return get_uint32(p) | (uint64_t(get_uint32(p+4))<<32);
+  }
+  void put_uint16(std::vector<uint8_t>& out, uint16_t value) {
+    out.push_back(static_cast<uint8_t>(value));
+    out.push_back(static_cast<uint8_t>(value >> 8));
+  }
+  void put_uint32(std::vector<uint8_t>& out, uint32_t value) {
+    put_uint16(out, static_cast<uint16_t>(value));
+    put_uint16(out, static_cast<uint16_t>(value >> 16));
+  }
+  void put_uint64(std::vector<uint8_t>& out, uint64_t value) {
+    put_uint32(out, static_cast<uint32_t>(value));
+    put_uint32(out, static_cast<uint32_t>(value >> 32));
+  }
+  void read_at(std::fstream& f, uint64_t pos, void* buf, size_t len) {
+    f.seekg(static_cast<std::streamoff>(pos));
+    f.read(reinterpret_cast<char*>(buf), len);
+  }
+  // everything we need to know about the zipfile to rewrite its end
+  struct zip_end {
+    uint64_t count, cd_offset;
+    std::vector<uint8_t> cd;
+    std::string comment;
+    bool zip64;
+  };
+  zip_end read_end(std::fstream& f, uint64_t file_size) {
+    zip_end ret;
+    if(file_size < END_OF_CENTRAL_DIRECTORY_LEN)
+      throw std::runtime_error("file too small to possibly be a zipfile");
+    uint64_t tail_len = std::min<uint64_t>(file_size,
+                                           65535 + END_OF_CENTRAL_DIRECTORY_LEN);
+    std::vector<uint8_t> tail(static_cast<size_t>(tail_len));
+    read_at(f, file_size - tail_len, tail.data(), tail.size());
+    size_t eocd = tail.size() - END_OF_CENTRAL_DIRECTORY_LEN;
+    while(get_uint32(&tail[eocd]) != 0x06054b50) {
+      if(eocd == 0)
+        throw std::runtime_error("file does not appear to contain a zipfile");
+      --eocd;
+    }
+    const uint8_t* p = &tail[eocd];
+    uint64_t eocd_pos = file_size - tail_len + eocd;
+    ret.count = get_uint16(p+10);
+    uint64_t cd_size = get_uint32(p+12);
+    ret.cd_offset = get_uint32(p+16);
+    uint16_t comment_length = get_uint16(p+20);
+    if(comment_length > tail.size() - eocd - END_OF_CENTRAL_DIRECTORY_LEN)
+      throw std::runtime_error("end of central directory record is corrupted");
+    ret.comment.assign(reinterpret_cast<const char*>(p+22), comment_length);
+    ret.zip64 = false;
+    if(eocd_pos >= ZIP64_LOCATOR_LEN) {
+      uint8_t locator[ZIP64_LOCATOR_LEN];
+      read_at(f, eocd_pos - ZIP64_LOCATOR_LEN, locator, sizeof(locator));
+      if(get_uint32(locator) == 0x07064b50) {
+        uint8_t record[ZIP64_END_OF_CENTRAL_DIRECTORY_LEN];
+        read_at(f, get_uint64(locator+8), record, sizeof(record));
+        if(get_uint32(record) != 0x06064b50)
+          throw std::runtime_error("Zip64 end of central directory record is corrupted");
+        ret.count = get_uint64(record+32);
+        cd_size = get_uint64(record+40);
+        ret.cd_offset = get_uint64(record+48);
+        ret.zip64 = true;
+      }
+    }
+    if(ret.cd_offset > file_size || cd_size > file_size - ret.cd_offset)
+      throw std::runtime_error("central directory is corrupted");
+    ret.cd.resize(static_cast<size_t>(cd_size));
+    read_at(f, ret.cd_offset, ret.cd.data(), ret.cd.size());
+    if(!f) throw std::runtime_error("could not read the central directory");
+    return ret;
+  }
+  void run(const std::string& path) {
+    std::fstream f(path, std::ios::in | std::ios::out | std::ios::binary);
+    if(!f) throw std::runtime_error("could not open " + path);
+    f.seekg(0, std::ios::end);
+    uint64_t file_size = static_cast<uint64_t>(f.tellg());
+    auto end = read_end(f, file_size);
+    // find the last record, which is the old index if there is one
+    size_t pos = 0, last = 0;
+    for(uint64_t n = 0; n < end.count; ++n) {
+      if(end.cd.size() - pos < CENTRAL_DIRECTORY_RECORD_LEN
+         || get_uint32(&end.cd[pos]) != 0x02014b50)
+        throw std::runtime_error("central directory is corrupted");
+      last = pos;
+      pos += CENTRAL_DIRECTORY_RECORD_LEN + get_uint16(&end.cd[pos+28])
+        + get_uint16(&end.cd[pos+30]) + get_uint16(&end.cd[pos+32]);
+      if(pos > end.cd.size())
+        throw std::runtime_error("central directory is corrupted");
+      TEZ::string_view name(reinterpret_cast<const char*>
+                            (&end.cd[last + CENTRAL_DIRECTORY_RECORD_LEN]),
+                            get_uint16(&end.cd[last+28]));
+      if(name == TEZ::archive::INDEX_MEMBER_NAME && n != end.count - 1)
+        throw std::runtime_error("the old index isn't the last member; "
+                                 "delete it and try again");
+    }
+    uint64_t insert_pos = end.cd_offset;
+    uint64_t count = end.count;
+    if(count > 0
+       && TEZ::string_view(reinterpret_cast<const char*>
+                           (&end.cd[last + CENTRAL_DIRECTORY_RECORD_LEN]),
+                           get_uint16(&end.cd[last+28]))
+       == TEZ::archive::INDEX_MEMBER_NAME) {
+      // the old index goes, and the new one goes where it was
+      const uint8_t* record = &end.cd[last];
+      insert_pos = get_uint32(record+42);
+      if(insert_pos == 0xFFFFFFFF) {
+        // the offset is alone in its Zip64 extra field
+        const uint8_t* extra = record + CENTRAL_DIRECTORY_RECORD_LEN
+          + get_uint16(record+28);
+        if(get_uint16(record+30) < 12 || get_uint16(extra) != 0x0001)
+          throw std::runtime_error("central directory is corrupted");
+        insert_pos = get_uint64(extra+4);
+      }
+      uint8_t header[LOCAL_FILE_HEADER_LEN];
+      read_at(f, insert_pos, header, sizeof(header));
+      if(!f || get_uint32(header) != 0x04034b50
+         || insert_pos + LOCAL_FILE_HEADER_LEN + get_uint16(header+26)
+         + get_uint16(header+28) + get_uint32(record+20) != end.cd_offset)
+        throw std::runtime_error("the old index isn't right before the "
+                                 "central directory; delete it and try again");
+      end.cd.resize(last);
+      --count;
+    }
+    std::vector<uint8_t> index;
+    {
+      TEZ::archive tez;
+      tez.mount(path);
+      index = tez.serialize_index(end.cd.size(),
+                                  TEZ::crc32_update(0, end.cd.data(),
+                                                    end.cd.size()));
+    }
+    if(index.size() >= 0xFFFFFFFF)
+      throw std::length_error("index is too big");
+    uint32_t crc = TEZ::crc32_update(0, index.data(), index.size());
+    uint32_t index_len = static_cast<uint32_t>(index.size());
+    TEZ::string_view name(TEZ::archive::INDEX_MEMBER_NAME);
+    uint16_t name_len = static_cast<uint16_t>(name.size());
+    bool offset_is_zip64 = insert_pos >= 0xFFFFFFFF;
+    uint16_t version = offset_is_zip64 ? 45 : 10;
+    std::vector<uint8_t> out;
+    // local file header
+    put_uint32(out, 0x04034b50);
+    put_uint16(out, version);
+    put_uint16(out, 0); // flags
+    put_uint16(out, 0); // stored
+    put_uint16(out, 0); // time
+    put_uint16(out, 0x21); // date (1980-01-01)
+    put_uint32(out, crc);
+    put_uint32(out, index_len);
+    put_uint32(out, index_len);
+    put_uint16(out, name_len);
+    put_uint16(out, 0);
+    out.insert(out.end(), name.begin(), name.end());
+    out.insert(out.end(), index.begin(), index.end());
+    // the new central directory: the old one, plus the index's record
+    uint64_t cd_offset = insert_pos + out.size();
+    out.insert(out.end(), end.cd.begin(), end.cd.end());
+    put_uint32(out, 0x02014b50);
+    put_uint16(out, version); // made by
+    put_uint16(out, version); // needed
+    put_uint16(out, 0);
+    put_uint16(out, 0);
+    put_uint16(out, 0);
+    put_uint16(out, 0x21);
+    put_uint32(out, crc);
+    put_uint32(out, index_len);
+    put_uint32(out, index_len);
+    put_uint16(out, name_len);
+    put_uint16(out, offset_is_zip64 ? 12 : 0); // extra
+    put_uint16(out, 0); // comment
+    put_uint16(out, 0); // disk
+    put_uint16(out, 0); // internal attributes
+    put_uint32(out, 0); // external attributes
+    put_uint32(out, offset_is_zip64 ? 0xFFFFFFFF
+               : static_cast<uint32_t>(insert_pos));
+    out.insert(out.end(), name.begin(), name.end());
+    if(offset_is_zip64) {
+      put_uint16(out, 0x0001);
+      put_uint16(out, 8);
+      put_uint64(out, insert_pos);
+    }
+    ++count;
+    uint64_t cd_size = insert_pos + out.size() - cd_offset;
+    bool zip64 = end.zip64 || count >= 0xFFFF || cd_size >= 0xFFFFFFFF
+      || cd_offset >= 0xFFFFFFFF;
+    if(zip64) {
+      uint64_t record_pos = insert_pos + out.size();
+      put_uint32(out, 0x06064b50);
+      put_uint64(out, ZIP64_END_OF_CENTRAL_DIRECTORY_LEN - 12);
+      put_uint16(out, 45);
+      put_uint16(out, 45);
+      put_uint32(out, 0);
+      put_uint32(out, 0);
+      put_uint64(out, count);
+      put_uint64(out, count);
+      put_uint64(out, cd_size);
+      put_uint64(out, cd_offset);
+      put_uint32(out, 0x07064b50);
+      put_uint32(out, 0);
+      put_uint64(out, record_pos);
+      put_uint32(out, 1);
+    }
+    put_uint32(out, 0x06054b50);
+    put_uint16(out, 0);
+    put_uint16(out, 0);
+    put_uint16(out, zip64 ? 0xFFFF : static_cast<uint16_t>(count));
+    put_uint16(out, zip64 ? 0xFFFF : static_cast<uint16_t>(count));
+    put_uint32(out, zip64 ? 0xFFFFFFFF : static_cast<uint32_t>(cd_size));
+    put_uint32(out, zip64 ? 0xFFFFFFFF : static_cast<uint32_t>(cd_offset));
+    put_uint16(out, static_cast<uint16_t>(end.comment.size()));
+    out.insert(out.end(), end.comment.begin(), end.comment.end());
+    f.clear();
+    f.seekp(static_cast<std::streamoff>(insert_pos));
+    f.write(reinterpret_cast<const char*>(out.data()), out.size());
+    f.close();
+    if(!f) throw std::runtime_error("could not write " + path);
+    // the old index might have been bigger than the new one
+    uint64_t new_size = insert_pos + out.size();
+    if(new_size < file_size) {
+#if defined(WIN32)
+      int fd = _open(path.c_str(), _O_RDWR | _O_BINARY);
+      bool ok = fd >= 0 && _chsize_s(fd, new_size) == 0;
+      if(fd >= 0) _close(fd);
+#else
+      bool ok = truncate(path.c_str(), static_cast<off_t>(new_size)) == 0;
+#endif
+      if(!ok) throw std::runtime_error("could not truncate " + path);
+    }
+    std::cout << path << ": indexed " << count - 1 << " files\n";
+  }
+}
+
+int main(int argc, char* argv[]) {
+  if(argc < 2) {
+    std::cerr << "usage: " << argv[0] << " zipfile-or-executable...\n";
+    return 2;
+  }
+  int ret = 0;
+  for(int n = 1; n < argc; ++n) {
+    try { run(argv[n]); }
+    catch(const std::exception& e) {
+      std::cerr << argv[n] << ": " << e.what() << "\n";
+      ret = 1;
+    }
+  }
+  return ret;
+}
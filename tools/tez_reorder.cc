@@ -0,0 +1,372 @@
+// Rewrites a zipfile (or an executable with one appended) so that its members
+// are stored in the order they are listed in a trace file, one name per line,
+// followed by the rest in their original order. Lay a program's files out in
+// the order it reads them at startup (see TEZ::archive::start_access_trace),
+// and its cold start becomes one sequential sweep through the executable
+// instead of a scattering of seeks.
+//
+// The rewritten zipfile's offsets are relative to the start of the file, as
+// after zip --adjust-sfx, whether or not they were before. An embedded index
+// (see tez_index.cc) is dropped, since it would no longer match; run
+// tez_index again afterward.
+//
+//   g++ -std=c++14 -O2 tez_reorder.cc -o tez_reorder
+//   tez_reorder my_program startup_trace.txt
+
+#include <stdio.h>
+
+#include <algorithm>
+#include <cstdint>
+#include <fstream>
+#include <iostream>
+#include <stdexcept>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#if defined(WIN32)
+#include <io.h>
+#include <fcntl.h>
+#else
+#include <unistd.h>
+#endif
+
+namespace {
+  constexpr int END_OF_CENTRAL_DIRECTORY_LEN = 22;
+  constexpr int CENTRAL_DIRECTORY_RECORD_LEN = 46;
+  constexpr int ZIP64_LOCATOR_LEN = 20;
+  constexpr int ZIP64_END_OF_CENTRAL_DIRECTORY_LEN = 56;
+  // see TEZ::archive::INDEX_MEMBER_NAME
+  const char INDEX_MEMBER_NAME[] = ".tez_index";
+  inline uint16_t get_uint16(const uint8_t* p) {
+    return p[0] | (uint16_t(p[1])<<8);
+  }
+  inline uint32_t get_uint32(const uint8_t* p) {
+    return get_uint16(p) | (uint32_t(get_uint16(p+2))<<16);
+  }
+  inline uint64_t get_uint64(const uint8_t* p) {
+    return get_uint32(p) | (uint64_t(get_uint32(p+4))<<32);
+  }
+  void put_uint16(std::vector<uint8_t>& out, uint16_t value) {
+    out.push_back(static_cast<uint8_t>(value));
+    out.push_back(static_cast<uint8_t>(value >> 8));
+  }
+  void put_uint32(std::vector<uint8_t>& out, uint32_t value) {
+    put_uint16(out, static_cast<uint16_t>(value));
+    put_uint16(out, static_cast<uint16_t>(value >> 16));
+  }
+  void put_uint64(std::vector<uint8_t>& out, uint64_t value) {
+    put_uint32(out, static_cast<uint32_t>(value));
+    put_uint32(out, static_cast<uint32_t>(value >> 32));
+  }
+  void set_uint16(uint8_t* p, uint16_t value) {
+    p[0] = static_cast<uint8_t>(value);
+    p[1] = static_cast<uint8_t>(value >> 8);
+  }
+  void set_uint32(uint8_t* p, uint32_t value) {
+    set_uint16(p, static_cast<uint16_t>(value));
+    set_uint16(p+2, static_cast<uint16_t>(value >> 16));
+  }
+  void set_uint64(uint8_t* p, uint64_t value) {
+    set_uint32(p, static_cast<uint32_t>(value));
+    set_uint32(p+4, static_cast<uint32_t>(value >> 32));
+  }
+  void read_at(std::fstream& f, uint64_t pos, void* buf, size_t len) {
+    f.seekg(static_cast<std::streamoff>(pos));
+    f.read(reinterpret_cast<char*>(buf), len);
+  }
+  struct member {
+    // its central directory record, including the name, extra field and
+    // comment
+    std::vector<uint8_t> record;
+    std::string name;
+    // where its local header starts, and where the next member (or the
+    // central directory) starts, in the file as it is now
+    uint64_t start, end;
+  };
+  // where the Zip64 extra field of a record keeps the offset, relative to the
+  // start of the record, or 0 if it doesn't
+  size_t zip64_offset_pos(const std::vector<uint8_t>& record) {
+    if(get_uint32(&record[42]) != 0xFFFFFFFF) return 0;
+    size_t pos = CENTRAL_DIRECTORY_RECORD_LEN + get_uint16(&record[28]);
+    size_t extra_end = pos + get_uint16(&record[30]);
+    while(extra_end - pos >= 4) {
+      uint16_t id = get_uint16(&record[pos]);
+      uint16_t len = get_uint16(&record[pos+2]);
+      if(len > extra_end - pos - 4) break;
+      if(id == 0x0001) {
+        // the sizes come first, if they're there
+        size_t field = pos + 4;
+        if(get_uint32(&record[24]) == 0xFFFFFFFF) field += 8;
+        if(get_uint32(&record[20]) == 0xFFFFFFFF) field += 8;
+        if(field + 8 > pos + 4 + len) break;
+        return field;
+      }
+      pos += 4 + len;
+    }
+    throw std::runtime_error("central directory is corrupted");
+  }
+  uint64_t get_offset(const std::vector<uint8_t>& record) {
+    size_t pos = zip64_offset_pos(record);
+    return pos != 0 ? get_uint64(&record[pos]) : get_uint32(&record[42]);
+  }
+  void set_offset(std::vector<uint8_t>& record, uint64_t offset) {
+    size_t pos = zip64_offset_pos(record);
+    if(pos != 0) set_uint64(&record[pos], offset);
+    else if(offset < 0xFFFFFFFF)
+      set_uint32(&record[42], static_cast<uint32_t>(offset));
+    else {
+      // it doesn't fit anymore, so it needs a Zip64 extra field of its own
+      // (any Zip64 sizes are in a separate one, which is fine)
+      size_t extra_end = CENTRAL_DIRECTORY_RECORD_LEN + get_uint16(&record[28])
+        + get_uint16(&record[30]);
+      if(get_uint16(&record[30]) > 0xFFFF - 12 || get_uint32(&record[24])
+         == 0xFFFFFFFF || get_uint32(&record[20]) == 0xFFFFFFFF)
+        throw std::runtime_error("couldn't give a member a Zip64 offset");
+      std::vector<uint8_t> extra;
+      put_uint16(extra, 0x0001);
+      put_uint16(extra, 8);
+      put_uint64(extra, offset);
+      record.insert(record.begin() + extra_end, extra.begin(), extra.end());
+      set_uint16(&record[30], get_uint16(&record[30]) + 12);
+      set_uint32(&record[42], 0xFFFFFFFF);
+      if(get_uint16(&record[6]) < 45) set_uint16(&record[6], 45);
+    }
+  }
+  void copy(std::fstream& in, uint64_t pos, uint64_t len, std::ostream& out) {
+    std::vector<char> buf(1 << 20);
+    in.seekg(static_cast<std::streamoff>(pos));
+    while(len > 0) {
+      size_t amount = len > buf.size() ? buf.size() : size_t(len);
+      in.read(buf.data(), amount);
+      if(!in) throw std::runtime_error("could not read member data");
+      out.write(buf.data(), amount);
+      len -= amount;
+    }
+  }
+  void run(const std::string& path, const std::string& trace_path) {
+    std::vector<std::string> trace;
+    {
+      std::ifstream f(trace_path);
+      if(!f) throw std::runtime_error("could not open " + trace_path);
+      std::string line;
+      while(std::getline(f, line)) {
+        if(!line.empty() && line.back() == '\r') line.pop_back();
+        if(!line.empty()) trace.push_back(line);
+      }
+    }
+    std::fstream f(path, std::ios::in | std::ios::out | std::ios::binary);
+    if(!f) throw std::runtime_error("could not open " + path);
+    f.seekg(0, std::ios::end);
+    uint64_t file_size = static_cast<uint64_t>(f.tellg());
+    if(file_size < END_OF_CENTRAL_DIRECTORY_LEN)
+      throw std::runtime_error("file too small to possibly be a zipfile");
+    uint64_t tail_len = std::min<uint64_t>(file_size,
+                                           65535 + END_OF_CENTRAL_DIRECTORY_LEN);
+    std::vector<uint8_t> tail(static_cast<size_t>(tail_len));
+    read_at(f, file_size - tail_len, tail.data(), tail.size());
+    size_t eocd = tail.size() - END_OF_CENTRAL_DIRECTORY_LEN;
+    while(get_uint32(&tail[eocd]) != 0x06054b50) {
+      if(eocd == 0)
+        throw std::runtime_error("file does not appear to contain a zipfile");
+      --eocd;
+    }
+    const uint8_t* p = &tail[eocd];
+    uint64_t eocd_pos = file_size - tail_len + eocd;
+    uint64_t count = get_uint16(p+10);
+    uint64_t cd_size = get_uint32(p+12);
+    uint64_t cd_offset = get_uint32(p+16);
+    uint16_t comment_length = get_uint16(p+20);
+    if(comment_length > tail.size() - eocd - END_OF_CENTRAL_DIRECTORY_LEN)
+      throw std::runtime_error("end of central directory record is corrupted");
+    std::string comment(reinterpret_cast<const char*>(p+22), comment_length);
+    // the central directory ends where the (Zip64) end of central directory
+    // record starts; we find that by position rather than trusting the
+    // offsets, since they may not have been adjusted
+    uint64_t cd_end = eocd_pos;
+    bool zip64 = false;
+    if(eocd_pos >= ZIP64_LOCATOR_LEN + ZIP64_END_OF_CENTRAL_DIRECTORY_LEN) {
+      uint8_t locator[ZIP64_LOCATOR_LEN];
+      read_at(f, eocd_pos - ZIP64_LOCATOR_LEN, locator, sizeof(locator));
+      if(get_uint32(locator) == 0x07064b50) {
+        uint8_t record[ZIP64_END_OF_CENTRAL_DIRECTORY_LEN];
+        cd_end = eocd_pos - ZIP64_LOCATOR_LEN
+          - ZIP64_END_OF_CENTRAL_DIRECTORY_LEN;
+        read_at(f, cd_end, record, sizeof(record));
+        if(get_uint32(record) != 0x06064b50)
+          throw std::runtime_error("Zip64 end of central directory record is corrupted");
+        count = get_uint64(record+32);
+        cd_size = get_uint64(record+40);
+        cd_offset = get_uint64(record+48);
+        zip64 = true;
+      }
+    }
+    if(cd_size > cd_end)
+      throw std::runtime_error("central directory is corrupted");
+    uint64_t cd_start = cd_end - cd_size;
+    // how far off the offsets are (zero, after zip --adjust-sfx)
+    uint64_t adjustment = cd_start - cd_offset;
+    std::vector<uint8_t> cd(static_cast<size_t>(cd_size));
+    read_at(f, cd_start, cd.data(), cd.size());
+    if(!f) throw std::runtime_error("could not read the central directory");
+    std::vector<member> members;
+    size_t pos = 0;
+    for(uint64_t n = 0; n < count; ++n) {
+      if(cd.size() - pos < CENTRAL_DIRECTORY_RECORD_LEN
+         || get_uint32(&cd[pos]) != 0x02014b50)
+        throw std::runtime_error("central directory is corrupted");
+      size_t len = CENTRAL_DIRECTORY_RECORD_LEN + get_uint16(&cd[pos+28])
+        + get_uint16(&cd[pos+30]) + get_uint16(&cd[pos+32]);
+      if(len > cd.size() - pos)
+        throw std::runtime_error("central directory is corrupted");
+      member m;
+      m.record.assign(cd.begin() + pos, cd.begin() + pos + len);
+      m.name.assign(reinterpret_cast<const char*>
+                    (&cd[pos + CENTRAL_DIRECTORY_RECORD_LEN]),
+                    get_uint16(&cd[pos+28]));
+      m.start = get_offset(m.record) + adjustment;
+      if(m.start >= cd_start)
+        throw std::runtime_error("central directory is corrupted");
+      members.emplace_back(std::move(m));
+      pos += len;
+    }
+    if(members.empty()) throw std::runtime_error("zipfile is empty");
+    // each member runs until the next one starts, which takes care of data
+    // descriptors and anything else between them
+    std::vector<size_t> by_position(members.size());
+    for(size_t n = 0; n < members.size(); ++n) by_position[n] = n;
+    std::stable_sort(by_position.begin(), by_position.end(),
+                     [&](size_t a, size_t b) {
+                       return members[a].start < members[b].start;
+                     });
+    for(size_t n = 0; n < by_position.size(); ++n) {
+      members[by_position[n]].end = n + 1 < by_position.size()
+        ? members[by_position[n+1]].start : cd_start;
+      if(members[by_position[n]].end == members[by_position[n]].start)
+        throw std::runtime_error("two members share the same data");
+    }
+    uint64_t zip_start = members[by_position[0]].start;
+    // the new order: first the trace, then everything else as it was
+    std::unordered_map<std::string, size_t> by_name;
+    for(size_t n = 0; n < members.size(); ++n)
+      by_name.emplace(members[n].name, n);
+    std::vector<bool> placed(members.size(), false);
+    std::vector<size_t> order;
+    size_t missing = 0;
+    for(auto& name : trace) {
+      auto it = by_name.find(name);
+      if(it == by_name.end()) ++missing;
+      else if(!placed[it->second]) {
+        placed[it->second] = true;
+        order.push_back(it->second);
+      }
+    }
+    size_t moved = order.size();
+    for(auto n : by_position) {
+      if(!placed[n]) order.push_back(n);
+    }
+    // write the new zipfile next to the old one, then copy it over, so that
+    // we don't need to hold it all in memory and the file keeps its
+    // permissions
+    std::string temp_path = path + ".reorder";
+    uint64_t new_size;
+    {
+      std::ofstream out(temp_path, std::ios::binary | std::ios::trunc);
+      if(!out) throw std::runtime_error("could not create " + temp_path);
+      uint64_t out_pos = zip_start;
+      std::vector<uint8_t> new_cd;
+      uint64_t new_count = 0;
+      bool dropped_index = false;
+      for(auto n : order) {
+        auto& m = members[n];
+        if(m.name == INDEX_MEMBER_NAME) {
+          dropped_index = true;
+          continue;
+        }
+        copy(f, m.start, m.end - m.start, out);
+        set_offset(m.record, out_pos);
+        new_cd.insert(new_cd.end(), m.record.begin(), m.record.end());
+        out_pos += m.end - m.start;
+        ++new_count;
+      }
+      uint64_t new_cd_offset = out_pos;
+      uint64_t new_cd_size = new_cd.size();
+      std::vector<uint8_t> end;
+      zip64 = zip64 || new_count >= 0xFFFF || new_cd_size >= 0xFFFFFFFF
+        || new_cd_offset >= 0xFFFFFFFF;
+      if(zip64) {
+        uint64_t record_pos = new_cd_offset + new_cd_size;
+        put_uint32(end, 0x06064b50);
+        put_uint64(end, ZIP64_END_OF_CENTRAL_DIRECTORY_LEN - 12);
+        put_uint16(end, 45);
+        put_uint16(end, 45);
+        put_uint32(end, 0);
+        put_uint32(end, 0);
+        put_uint64(end, new_count);
+        put_uint64(end, new_count);
+        put_uint64(end, new_cd_size);
+        put_uint64(end, new_cd_offset);
+        put_uint32(end, 0x07064b50);
+        put_uint32(end, 0);
+        put_uint64(end, record_pos);
+        put_uint32(end, 1);
+      }
+      put_uint32(end, 0x06054b50);
+      put_uint16(end, 0);
+      put_uint16(end, 0);
+      put_uint16(end, zip64 ? 0xFFFF : static_cast<uint16_t>(new_count));
+      put_uint16(end, zip64 ? 0xFFFF : static_cast<uint16_t>(new_count));
+      put_uint32(end, zip64 ? 0xFFFFFFFF : static_cast<uint32_t>(new_cd_size));
+      put_uint32(end, zip64 ? 0xFFFFFFFF
+                 : static_cast<uint32_t>(new_cd_offset));
+      put_uint16(end, static_cast<uint16_t>(comment.size()));
+      end.insert(end.end(), comment.begin(), comment.end());
+      out.write(reinterpret_cast<const char*>(new_cd.data()), new_cd.size());
+      out.write(reinterpret_cast<const char*>(end.data()), end.size());
+      out.close();
+      if(!out) throw std::runtime_error("could not write " + temp_path);
+      new_size = new_cd_offset + new_cd_size + end.size();
+      if(dropped_index)
+        std::cout << path << ": dropped the embedded index; run tez_index "
+          "again\n";
+    }
+    {
+      std::fstream in(temp_path, std::ios::in | std::ios::binary);
+      if(!in) throw std::runtime_error("could not reopen " + temp_path);
+      f.clear();
+      f.seekp(static_cast<std::streamoff>(zip_start));
+      copy(in, 0, new_size - zip_start, f);
+      f.close();
+      if(!f) throw std::runtime_error("could not write " + path);
+    }
+    remove(temp_path.c_str());
+    if(new_size < file_size) {
+#if defined(WIN32)
+      int fd = _open(path.c_str(), _O_RDWR | _O_BINARY);
+      bool ok = fd >= 0 && _chsize_s(fd, new_size) == 0;
+      if(fd >= 0) _close(fd);
+#else
+      bool ok = truncate(path.c_str(), static_cast<off_t>(new_size)) == 0;
+#endif
+      if(!ok) throw std::runtime_error("could not truncate " + path);
+    }
+    std::cout << path << ": moved " << moved << " of " << members.size()
+              << " members to the front";
+    if(missing > 0)
+      std::cout << " (" << missing << " traced names weren't in it)";
+    std::cout << "\n";
+  }
+}
+
+int main(int argc, char* argv[]) {
+  if(argc != 3) {
+    std::cerr << "usage: " << argv[0] << " zipfile-or-executable trace\n";
+    return 2;
+  }
+  try { run(argv[1], argv[2]); }
+  catch(const std::exception& e) {
+    std::cerr << argv[1] << ": " << e.what() << "\n";
+    return 1;
+  }
+  return 0;
+}